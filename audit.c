@@ -0,0 +1,192 @@
+/* audit.c - maple-util
+ *
+ * Audit mode.  Find out which boards in a rack carry which
+ * firmware, and how each one differs from a golden image.
+ *
+ * Every board we can find gets kicked into the loader, then
+ * all of them are read back at once, each in its own thread.
+ * We only read as much flash as the golden image covers, and
+ * we don't keep the data, just a hash of each transfer block.
+ * (The Maple loader has no way to hash flash for us, so every
+ * block does have to come over USB once.)  Boards are then
+ * grouped by digest, and for each group that does not match
+ * the golden image we list the blocks that differ.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <libusb.h>
+
+#include "maple.h"
+#include "hash.h"
+
+#define MAX_AUDIT	64
+
+/* Don't list more than this many differing blocks */
+#define MAX_DIFF_SHOW	16
+
+extern int show_progress;
+
+struct audit_board {
+	struct maple_device md;
+	char port[24];
+	struct dfu_dump dump;
+	int ok;
+	int group;
+	pthread_t thread;
+};
+
+static struct audit_board boards[MAX_AUDIT];
+static int audit_size;
+
+static void *
+audit_worker ( void *arg )
+{
+	struct audit_board *bp = arg;
+	struct maple_device *mp = &bp->md;
+
+	timeline_name ( bp->port );
+	if ( maple_open ( mp ) == 0 ) {
+	    bp->dump.max_blocks = (audit_size + mp->xfer_size - 1) / mp->xfer_size;
+	    bp->dump.block_hash = malloc ( bp->dump.max_blocks * sizeof(uint64_t) );
+	    if ( bp->dump.block_hash )
+		bp->ok = dfuload_do_upload ( mp, audit_size, -1, &bp->dump ) >= 0;
+	    perform_reset ( mp );
+	}
+	maple_close ( mp );
+	libusb_unref_device ( mp->dev );
+	return NULL;
+}
+
+/* Print the blocks of this board that are not like the golden image.
+ */
+static void
+audit_diff ( struct audit_board *bp, struct dfu_file *golden )
+{
+	int xfer = bp->md.xfer_size;
+	int nblk = (golden->size + xfer - 1) / xfer;
+	int len;
+	int i;
+	int ndiff = 0;
+
+	printf ( "    differs in blocks:" );
+	for ( i=0; i<nblk; i++ ) {
+	    len = golden->size - i * xfer;
+	    if ( len > xfer )
+		len = xfer;
+	    if ( i < bp->dump.nblocks &&
+		    bp->dump.block_hash[i] == hash_buf ( golden->buf + i * xfer, len ) )
+		continue;
+	    if ( ndiff++ < MAX_DIFF_SHOW )
+		printf ( " %d", i );
+	}
+	if ( ndiff > MAX_DIFF_SHOW )
+	    printf ( " ... (%d in all)", ndiff );
+	printf ( " of %d (%d bytes each)\n", nblk, xfer );
+}
+
+int
+audit_boards ( libusb_context *context, struct dfu_file *golden )
+{
+	struct maple_device md[MAX_AUDIT];
+	struct audit_board *bp;
+	uint64_t golden_hash;
+	unsigned long long t0;
+	int nloader;
+	int nkick;
+	int nb;
+	int ngroup = 0;
+	int i, j;
+	int bad = 0;
+
+	if ( file_wait ( golden ) )
+	    return 1;
+	audit_size = golden->size;
+	golden_hash = golden->digest;
+	printf ( "Golden image %s: %d bytes, hash %016llx\n",
+	    golden->name, golden->size, (unsigned long long) golden_hash );
+
+	/* How many are already in the loader */
+	nloader = find_all_maple ( context, md, MAX_AUDIT );
+	for ( i=0; i<nloader; i++ )
+	    libusb_unref_device ( md[i].dev );
+
+	/* The kicks and the wait go on the main track */
+	timeline_name ( "all boards" );
+	nkick = trigger_all_serial ();
+	if ( nkick ) {
+	    printf ( "Kicked %d boards into the loader\n", nkick );
+	    wait_all_loader ( context, nloader + nkick );
+	}
+
+	nb = find_all_maple ( context, md, MAX_AUDIT );
+	if ( nb == 0 ) {
+	    printf ( "No maple boards in loader mode\n" );
+	    return 1;
+	}
+
+	t0 = nano_time ();
+	show_progress = 0;
+	for ( i=0; i<nb; i++ ) {
+	    bp = &boards[i];
+	    memset ( bp, 0, sizeof(*bp) );
+	    bp->md = md[i];
+	    maple_port_path ( bp->md.dev, bp->port );
+	    pthread_create ( &bp->thread, NULL, audit_worker, bp );
+	}
+	for ( i=0; i<nb; i++ )
+	    pthread_join ( boards[i].thread, NULL );
+	show_progress = 1;
+
+	printf ( "Audited %d boards in %.3f seconds\n", nb, (nano_time() - t0) / 1.0e9 );
+
+	/* Group boards by what they hold */
+	for ( i=0; i<nb; i++ ) {
+	    bp = &boards[i];
+	    bp->group = -1;
+	    if ( ! bp->ok )
+		continue;
+	    for ( j=0; j<i; j++ ) {
+		if ( boards[j].ok && boards[j].dump.hash == bp->dump.hash &&
+			boards[j].dump.total == bp->dump.total ) {
+		    bp->group = boards[j].group;
+		    break;
+		}
+	    }
+	    if ( bp->group < 0 )
+		bp->group = ngroup++;
+	}
+
+	for ( i=0; i<ngroup; i++ ) {
+	    for ( j=0; boards[j].group != i; j++ )
+		;
+	    bp = &boards[j];
+	    printf ( "  %016llx", (unsigned long long) bp->dump.hash );
+	    if ( bp->dump.total == golden->size && bp->dump.hash == golden_hash )
+		printf ( " (golden)" );
+	    else
+		bad = 1;
+	    printf ( ":" );
+	    for ( ; j<nb; j++ )
+		if ( boards[j].group == i )
+		    printf ( " %s", boards[j].port );
+	    printf ( "\n" );
+	    if ( bp->dump.total != golden->size || bp->dump.hash != golden_hash )
+		audit_diff ( bp, golden );
+	}
+
+	for ( i=0; i<nb; i++ ) {
+	    if ( ! boards[i].ok ) {
+		printf ( "  could not read: %s\n", boards[i].port );
+		bad = 1;
+	    }
+	    free ( boards[i].dump.block_hash );
+	}
+
+	return bad;
+}
+
+/* THE END */
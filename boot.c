@@ -0,0 +1,180 @@
+/* boot.c - maple-util
+ *
+ * Boot confirmation.  After the reset we want to know that the
+ * application actually came up, not find out in functional test.
+ * A good board drops off the bus and shows up again on the same
+ * port as 1eaf:0004 (or whatever the application says it is).
+ * A bad one comes back as the loader again, or never comes back.
+ *
+ * We let libusb hotplug tell us about arrivals and departures
+ * rather than sleeping and looking, so the time to application
+ * is good to a millisecond or so.  Some platforms lack hotplug,
+ * there we fall back to looking at the device list every few ms.
+ *
+ * The board is known by its port path (see maple_port_path),
+ * since the address changes every time it enumerates.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <libusb.h>
+
+#include "maple.h"
+
+extern int verbose;
+
+/* How often we look when we have to poll */
+#define BOOT_POLL	5	/* ms */
+
+/* What we have seen on the port so far */
+#define SEEN_NOTHING	0
+#define SEEN_LOADER	1
+#define SEEN_GONE	2
+#define SEEN_APP	3
+
+struct boot_watch {
+	char *port;
+	int vendor;
+	int product;
+	int seen;
+	unsigned long long t_app;
+};
+
+/* What is this device to us, if it is on our port.
+ */
+static int
+boot_classify ( struct boot_watch *bp, libusb_device *dev )
+{
+	struct libusb_device_descriptor desc;
+	char path[32];
+
+	maple_port_path ( dev, path );
+	if ( strcmp ( path, bp->port ) != 0 )
+	    return SEEN_NOTHING;
+	if ( libusb_get_device_descriptor ( dev, &desc ) )
+	    return SEEN_NOTHING;
+	if ( desc.idVendor == bp->vendor && desc.idProduct == bp->product )
+	    return SEEN_APP;
+	if ( profile_kind ( &desc ) == MAPLE_LOADER )
+	    return SEEN_LOADER;
+	return SEEN_NOTHING;
+}
+
+static void
+boot_note ( struct boot_watch *bp, int seen )
+{
+	if ( bp->seen == SEEN_APP || seen == SEEN_NOTHING )
+	    return;
+	if ( verbose > 1 && seen != bp->seen )
+	    printf ( "Port %s: %s\n", bp->port,
+		seen == SEEN_APP ? "application" : seen == SEEN_LOADER ? "loader" : "gone" );
+	bp->seen = seen;
+	if ( seen == SEEN_APP )
+	    bp->t_app = nano_time ();
+}
+
+static int
+boot_hotplug ( libusb_context *context, libusb_device *dev,
+	libusb_hotplug_event event, void *arg )
+{
+	struct boot_watch *bp = (struct boot_watch *) arg;
+	int seen;
+
+	seen = boot_classify ( bp, dev );
+	if ( seen != SEEN_NOTHING && event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT )
+	    seen = SEEN_GONE;
+	boot_note ( bp, seen );
+	return 0;
+}
+
+/* No hotplug here, look at the whole list.
+ */
+static void
+boot_scan ( libusb_context *context, struct boot_watch *bp )
+{
+	libusb_device **list;
+	ssize_t ndev;
+	int seen = SEEN_GONE;
+	int s;
+	int i;
+
+	ndev = maple_device_list ( context, &list );
+	for ( i=0; i<ndev; i++ ) {
+	    s = boot_classify ( bp, list[i] );
+	    if ( s != SEEN_NOTHING )
+		seen = s;
+	}
+	maple_free_list ( list );
+	boot_note ( bp, seen );
+}
+
+/* Wait up to deadline ms (from t0, when the reset went out)
+ * for the board on port to come up as vendor:product.
+ * Returns 0 if it did, with the time it took in *t_boot.
+ */
+int
+boot_confirm ( libusb_context *context, char *port, int vendor, int product,
+	unsigned long long t0, int deadline, unsigned long long *t_boot )
+{
+	struct boot_watch watch;
+	libusb_hotplug_callback_handle handle;
+	unsigned long long t_end;
+	unsigned long long now;
+	struct timeval tv;
+	int hotplug;
+
+	memset ( &watch, 0, sizeof(watch) );
+	watch.port = port;
+	watch.vendor = vendor;
+	watch.product = product;
+	watch.seen = SEEN_LOADER;
+
+	t_end = t0 + deadline * 1000000ULL;
+
+	hotplug = libusb_has_capability ( LIBUSB_CAP_HAS_HOTPLUG );
+	if ( hotplug && libusb_hotplug_register_callback ( context,
+		LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+		LIBUSB_HOTPLUG_ENUMERATE,
+		LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+		boot_hotplug, &watch, &handle ) != LIBUSB_SUCCESS )
+	    hotplug = 0;
+
+	while ( watch.seen != SEEN_APP ) {
+	    now = nano_time ();
+	    if ( now >= t_end )
+		break;
+	    if ( hotplug ) {
+		tv.tv_sec = (t_end - now) / 1000000000ULL;
+		tv.tv_usec = ((t_end - now) % 1000000000ULL) / 1000;
+		libusb_handle_events_timeout_completed ( context, &tv, NULL );
+	    } else {
+		boot_scan ( context, &watch );
+		if ( watch.seen != SEEN_APP )
+		    milli_sleep ( BOOT_POLL );
+	    }
+	}
+
+	if ( hotplug )
+	    libusb_hotplug_deregister_callback ( context, handle );
+	timeline_span ( "boot_confirm", t0, nano_time () );
+
+	switch ( watch.seen ) {
+	    case SEEN_APP:
+		*t_boot = watch.t_app - t0;
+		printf ( "Board %s booted as %04x:%04x in %.1f ms\n", port,
+		    vendor, product, *t_boot / 1.0e6 );
+		return 0;
+	    case SEEN_GONE:
+		printf ( "Board %s vanished, nothing there after %d ms !!\n", port, deadline );
+		break;
+	    case SEEN_LOADER:
+	    default:
+		printf ( "Board %s still in the loader after %d ms !!\n", port, deadline );
+		break;
+	}
+	return 1;
+}
+
+/* THE END */
@@ -0,0 +1,328 @@
+/* bundle.c - maple-util
+ *
+ * Bundle mode.  A rack holds boards doing different jobs, and
+ * each job has its own firmware.  A bundle manifest says which
+ * image goes to which board, and -i manifest flashes the lot.
+ *
+ * The manifest is lines like:
+ *
+ *   # motor controllers
+ *   serial=MC0012	motor.bin
+ *   port=1-1.2		sensor.bin
+ *   port=1-1.3		sensor.bin
+ *   default		blink.bin
+ *
+ * A board matches by USB serial number first, then by port path,
+ * then takes the default if there is one.  Boards that match
+ * nothing are left alone (just reset back to their application).
+ * Image names are relative to the directory the manifest is in.
+ *
+ * Each image is read once, however many boards get it, and all
+ * the workers send from that same buffer.  Each board checks the
+ * image (see image.c) against its own profile before sending it.
+ * Every board is kicked into the loader, then each one gets its
+ * own thread, as in audit mode.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <libusb.h>
+
+#include "maple.h"
+
+#define MAX_BUNDLE_IMAGES	32
+#define MAX_BUNDLE_RULES	256
+#define MAX_BUNDLE		64	/* boards, as MAX_AUDIT */
+
+extern int show_progress;
+extern int boot_deadline;
+extern int boot_vendor;
+extern int boot_product;
+extern int image_checks;
+
+#define MATCH_SERIAL	0
+#define MATCH_PORT	1
+#define MATCH_DEFAULT	2
+
+struct bundle_rule {
+	int how;
+	char key[32];
+	struct dfu_file *image;
+};
+
+struct bundle_board {
+	struct maple_device md;
+	char port[32];
+	char serial[32];
+	struct dfu_file *image;
+	int result;		/* as flash_board */
+	unsigned long long t_total;
+	pthread_t thread;
+};
+
+static struct dfu_file images[MAX_BUNDLE_IMAGES];
+static int nimages;
+
+static struct bundle_rule rules[MAX_BUNDLE_RULES];
+static int nrules;
+
+static struct bundle_board boards[MAX_BUNDLE];
+
+static libusb_context *bundle_context;
+
+/* Read an image, unless we already have it.
+ */
+static struct dfu_file *
+bundle_image ( char *dir, char *name )
+{
+	char path[256];
+	struct dfu_file *fp;
+	int i;
+
+	if ( name[0] == '/' || ! dir[0] )
+	    snprintf ( path, sizeof(path), "%s", name );
+	else
+	    snprintf ( path, sizeof(path), "%s/%s", dir, name );
+
+	for ( i=0; i<nimages; i++ )
+	    if ( strcmp ( images[i].name, path ) == 0 )
+		return &images[i];
+
+	if ( nimages == MAX_BUNDLE_IMAGES ) {
+	    printf ( "Too many images in bundle, %d is the limit\n", MAX_BUNDLE_IMAGES );
+	    return NULL;
+	}
+
+	fp = &images[nimages];
+	fp->name = strdup ( path );
+	if ( get_file ( fp ) || fp->size == 0 ) {
+	    printf ( "Cannot read image: %s\n", path );
+	    return NULL;
+	}
+	nimages++;
+	return fp;
+}
+
+/* Returns 0 if the manifest made sense.
+ */
+static int
+bundle_load ( char *path )
+{
+	char dir[256];
+	char line[256];
+	char key[64];
+	char name[192];
+	struct bundle_rule *rp;
+	char *p;
+	FILE *fp;
+	int lnum = 0;
+	int n;
+
+	fp = fopen ( path, "r" );
+	if ( ! fp ) {
+	    printf ( "Cannot open bundle manifest: %s\n", path );
+	    return 1;
+	}
+
+	p = strrchr ( path, '/' );
+	if ( p )
+	    snprintf ( dir, sizeof(dir), "%.*s", (int) (p - path), path );
+	else
+	    dir[0] = '\0';
+
+	while ( fgets ( line, sizeof(line), fp ) ) {
+	    lnum++;
+	    p = line;
+	    while ( *p == ' ' || *p == '\t' )
+		p++;
+	    if ( *p == '#' || *p == '\n' || *p == '\0' )
+		continue;
+
+	    n = sscanf ( p, "%63s %191s", key, name );
+	    if ( n != 2 || nrules == MAX_BUNDLE_RULES )
+		goto bad;
+
+	    rp = &rules[nrules];
+	    p = NULL;
+	    if ( strncmp ( key, "serial=", 7 ) == 0 ) {
+		rp->how = MATCH_SERIAL;
+		p = key + 7;
+	    } else if ( strncmp ( key, "port=", 5 ) == 0 ) {
+		rp->how = MATCH_PORT;
+		p = key + 5;
+	    } else if ( strcmp ( key, "default" ) == 0 )
+		rp->how = MATCH_DEFAULT;
+	    else
+		goto bad;
+
+	    /* A key that does not fit could never match, say so */
+	    if ( p ) {
+		if ( strlen ( p ) >= sizeof(rp->key) )
+		    goto bad;
+		strcpy ( rp->key, p );
+	    }
+
+	    rp->image = bundle_image ( dir, name );
+	    if ( ! rp->image ) {
+		fclose ( fp );
+		return 1;
+	    }
+	    nrules++;
+	}
+	fclose ( fp );
+
+	if ( nrules == 0 ) {
+	    printf ( "Nothing in bundle manifest %s\n", path );
+	    return 1;
+	}
+	return 0;
+
+bad:
+	printf ( "Bad line %d in bundle manifest %s\n", lnum, path );
+	fclose ( fp );
+	return 1;
+}
+
+static struct dfu_file *
+bundle_match ( struct bundle_board *bp )
+{
+	int how;
+	int i;
+
+	for ( how = MATCH_SERIAL; how <= MATCH_DEFAULT; how++ ) {
+	    for ( i=0; i<nrules; i++ ) {
+		if ( rules[i].how != how )
+		    continue;
+		if ( how == MATCH_SERIAL && strcmp ( rules[i].key, bp->serial ) != 0 )
+		    continue;
+		if ( how == MATCH_PORT && strcmp ( rules[i].key, bp->port ) != 0 )
+		    continue;
+		return rules[i].image;
+	    }
+	}
+	return NULL;
+}
+
+static void *
+bundle_worker ( void *arg )
+{
+	struct bundle_board *bp = arg;
+	struct maple_device *mp = &bp->md;
+	unsigned long long t0, t1;
+	unsigned long long t_download = 0;
+	unsigned long long t_reset = 0;
+	unsigned long long t_boot = 0;
+	char *serial = NULL;
+	int s = 0;
+
+	t0 = nano_time ();
+	bp->result = 1;
+	timeline_name ( bp->port );
+	if ( maple_open ( mp ) == 0 ) {
+	    serial = board_serial ( mp );
+	    if ( serial )
+		strcpy ( bp->serial, serial );
+	    bp->image = bundle_match ( bp );
+
+	    if ( bp->image && image_checks && image_check ( bp->image, mp->prof ) )
+		printf ( "Not flashing %s to %s\n", bp->image->name, bp->port );
+	    else if ( bp->image ) {
+		t1 = nano_time ();
+		s = board_download ( mp, bp->image );
+		t_download = nano_time () - t1;
+		if ( s == bp->image->size )
+		    bp->result = 0;
+	    }
+	    t_reset = nano_time ();
+	    perform_reset ( mp );
+	}
+	maple_close ( mp );
+
+	if ( bp->image && bp->result == 0 && boot_deadline &&
+		boot_confirm ( bundle_context, bp->port, boot_vendor, boot_product,
+		    t_reset, boot_deadline, &t_boot ) )
+	    bp->result = 2;
+
+	if ( bp->image )
+	    history_add ( mp, serial ? bp->serial : NULL, bp->port, bp->image,
+		s, 0, t_download, t_boot, bp->result );
+
+	libusb_unref_device ( mp->dev );
+	bp->t_total = nano_time () - t0;
+	return NULL;
+}
+
+int
+bundle_boards ( libusb_context *context, char *manifest )
+{
+	struct maple_device md[MAX_BUNDLE];
+	struct bundle_board *bp;
+	unsigned long long t0;
+	int nloader;
+	int nkick;
+	int nb;
+	int i;
+	int bad = 0;
+
+	if ( bundle_load ( manifest ) )
+	    return 1;
+	for ( i=0; i<nimages; i++ )
+	    printf ( "Image %s: %d bytes\n", images[i].name, images[i].size );
+
+	bundle_context = context;
+
+	/* How many are already in the loader */
+	nloader = find_all_maple ( context, md, MAX_BUNDLE );
+	for ( i=0; i<nloader; i++ )
+	    libusb_unref_device ( md[i].dev );
+
+	/* The kicks and the wait go on the main track */
+	timeline_name ( "all boards" );
+	nkick = trigger_all_serial ();
+	if ( nkick ) {
+	    printf ( "Kicked %d boards into the loader\n", nkick );
+	    wait_all_loader ( context, nloader + nkick );
+	}
+
+	nb = find_all_maple ( context, md, MAX_BUNDLE );
+	if ( nb == 0 ) {
+	    printf ( "No maple boards in loader mode\n" );
+	    return 1;
+	}
+
+	t0 = nano_time ();
+	show_progress = 0;
+	for ( i=0; i<nb; i++ ) {
+	    bp = &boards[i];
+	    memset ( bp, 0, sizeof(*bp) );
+	    bp->md = md[i];
+	    maple_port_path ( bp->md.dev, bp->port );
+	    pthread_create ( &bp->thread, NULL, bundle_worker, bp );
+	}
+	for ( i=0; i<nb; i++ )
+	    pthread_join ( boards[i].thread, NULL );
+	show_progress = 1;
+
+	printf ( "Flashed %d boards in %.3f seconds\n", nb, (nano_time() - t0) / 1.0e9 );
+
+	for ( i=0; i<nb; i++ ) {
+	    bp = &boards[i];
+	    printf ( "  %-12s %-16s ", bp->port, bp->serial[0] ? bp->serial : "-" );
+	    if ( ! bp->image ) {
+		printf ( "no image for this board, left alone\n" );
+		continue;
+	    }
+	    printf ( "%-24s %s in %.3f s\n", bp->image->name,
+		bp->result == 0 ? "ok" : bp->result == 1 ? "FAILED" : "DID NOT BOOT",
+		bp->t_total / 1.0e9 );
+	    if ( bp->result )
+		bad = 1;
+	}
+
+	return bad;
+}
+
+/* THE END */
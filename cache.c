@@ -0,0 +1,234 @@
+/* cache.c - maple-util
+ *
+ * Prepared image cache.  With -C dir, images are kept in dir as
+ * get_file() left them: HEX and S-records parsed, the DFU suffix
+ * checked and stripped, and the digest worked out.  Entries are
+ * named by a hash of the file contents (along with anything else
+ * that changes how it is read, like -R and the app region), so a
+ * changed file just gets a new entry, and any number of copies of
+ * maple-util on a host can use the same dir.
+ *
+ * An entry is a header page followed by the image, so the image
+ * starts page (and so transfer) aligned.  We map it read only and
+ * shared, so every process flashing that image uses the same pages
+ * of the page cache, with no parsing and no copy.
+ *
+ * New entries are written to a temporary name and renamed into
+ * place, so nobody ever sees half of one.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <libusb.h>
+
+#include "maple.h"
+#include "hash.h"
+
+#define CACHE_MAGIC	0x474d49454c50414dULL	/* "MAPLEIMG" */
+#define CACHE_VERSION	1
+#define CACHE_HDR	4096	/* the image starts on the next page */
+
+/* We hash the source file this much at a time */
+#define CACHE_CHUNK	16384
+
+extern int ram_mode;
+
+struct cache_hdr {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t size;
+	uint64_t key;
+	uint64_t digest;
+	int32_t has_suffix;
+	int32_t suffix_vendor;
+	int32_t suffix_product;
+	int32_t suffix_bcd;
+};
+
+static char *cache_dir = NULL;
+
+int
+cache_open ( char *dir )
+{
+	if ( mkdir ( dir, 0755 ) < 0 && access ( dir, W_OK ) < 0 ) {
+	    printf ( "Cannot use image cache directory: %s\n", dir );
+	    return 1;
+	}
+	cache_dir = dir;
+	return 0;
+}
+
+/* What the entry for this file would be, from its contents.
+ * Returns 0 and fills in *key if we could read it.
+ */
+static int
+cache_key ( char *name, uint64_t *key )
+{
+	struct maple_profile *pp = profile_default ( MAPLE_LOADER );
+	unsigned int how[5];
+	char buf[CACHE_CHUNK];
+	uint64_t hash = HASH_INIT;
+	int empty = 1;
+	int fd;
+	int n;
+
+	fd = open ( name, O_RDONLY );
+	if ( fd < 0 )
+	    return 1;
+	while ( (n = read ( fd, buf, sizeof(buf) )) > 0 ) {
+	    hash = hash_update ( hash, buf, n );
+	    empty = 0;
+	}
+	close ( fd );
+	if ( n < 0 || empty )
+	    return 1;
+
+	/* A hex file reads differently for flash and RAM,
+	 * and the same bytes mean something else by another name.
+	 */
+	how[0] = ram_mode;
+	how[1] = ram_mode ? pp->ram_base : pp->flash_base;
+	how[2] = ram_mode ? pp->ram_size : pp->flash_size;
+	how[3] = hex_format ( name );
+	how[4] = compress_format ( name );
+	*key = hash_update ( hash, how, sizeof(how) );
+	return 0;
+}
+
+static void
+cache_path ( uint64_t key, char *path, int len )
+{
+	snprintf ( path, len, "%s/%016llx.img", cache_dir, (unsigned long long) key );
+}
+
+static int
+cache_map ( struct dfu_file *fp, char *path, uint64_t key )
+{
+	struct cache_hdr *hp;
+	struct stat st;
+	char *map;
+	int fd;
+
+	fd = open ( path, O_RDONLY );
+	if ( fd < 0 )
+	    return 1;
+	if ( fstat ( fd, &st ) < 0 || st.st_size < CACHE_HDR ) {
+	    close ( fd );
+	    return 1;
+	}
+	map = mmap ( NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+	close ( fd );
+	if ( map == MAP_FAILED )
+	    return 1;
+
+	hp = (struct cache_hdr *) map;
+	if ( hp->magic != CACHE_MAGIC || hp->version != CACHE_VERSION ||
+		hp->key != key || CACHE_HDR + hp->size != st.st_size ) {
+	    munmap ( map, st.st_size );
+	    return 1;
+	}
+
+	fp->buf = map + CACHE_HDR;
+	fp->size = hp->size;
+	fp->digest = hp->digest;
+	fp->mapped = st.st_size;
+	fp->has_suffix = hp->has_suffix;
+	fp->suffix_vendor = hp->suffix_vendor;
+	fp->suffix_product = hp->suffix_product;
+	fp->suffix_bcd = hp->suffix_bcd;
+	return 0;
+}
+
+/* Add what get_file() made of a file, then swap the heap copy
+ * for the mapping, so every process looks at the same pages.
+ */
+static void
+cache_put ( struct dfu_file *fp, char *path, uint64_t key )
+{
+	char page[CACHE_HDR];
+	char tmp[300];
+	struct cache_hdr *hp = (struct cache_hdr *) page;
+	char *buf;
+	int fd;
+
+	memset ( page, 0, sizeof(page) );
+	hp->magic = CACHE_MAGIC;
+	hp->version = CACHE_VERSION;
+	hp->size = fp->size;
+	hp->key = key;
+	hp->digest = fp->digest;
+	hp->has_suffix = fp->has_suffix;
+	hp->suffix_vendor = fp->suffix_vendor;
+	hp->suffix_product = fp->suffix_product;
+	hp->suffix_bcd = fp->suffix_bcd;
+
+	snprintf ( tmp, sizeof(tmp), "%s.%d", path, getpid () );
+	fd = open ( tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+	if ( fd < 0 )
+	    return;
+	if ( write ( fd, page, CACHE_HDR ) != CACHE_HDR ||
+		write ( fd, fp->buf, fp->size ) != fp->size ) {
+	    close ( fd );
+	    unlink ( tmp );
+	    return;
+	}
+	close ( fd );
+	if ( rename ( tmp, path ) < 0 ) {
+	    unlink ( tmp );
+	    return;
+	}
+
+	/* If it won't map, we still have the heap copy */
+	buf = fp->buf;
+	if ( cache_map ( fp, path, key ) == 0 ) {
+	    compress_done ( fp );
+	    free ( buf );
+	}
+}
+
+/* get_file() through the cache.  Returns 0 if all went well.
+ */
+int
+cache_get_file ( struct dfu_file *fp, int (*reader) ( struct dfu_file * ) )
+{
+	char path[280];
+	uint64_t key;
+
+	if ( ! cache_dir || cache_key ( fp->name, &key ) )
+	    return (*reader) ( fp );
+
+	cache_path ( key, path, sizeof(path) );
+	if ( cache_map ( fp, path, key ) == 0 )
+	    return 0;
+
+	if ( (*reader) ( fp ) )
+	    return 1;
+	if ( file_wait ( fp ) ) {
+	    put_file ( fp );
+	    return 1;
+	}
+	cache_put ( fp, path, key );
+	return 0;
+}
+
+/* Give back what get_file() gave us */
+void
+put_file ( struct dfu_file *fp )
+{
+	compress_done ( fp );
+	if ( fp->mapped )
+	    munmap ( fp->buf - CACHE_HDR, fp->mapped );
+	else
+	    free ( fp->buf );
+	fp->buf = NULL;
+	fp->mapped = 0;
+}
+
+/* THE END */
@@ -0,0 +1,330 @@
+/* capture.c - maple-util
+ *
+ * Capture mode.  Once the boards are flashed, functional test
+ * wants whatever they say on their serial ports.  Here we open
+ * every Maple tty we can find, wait on all of them at once with
+ * epoll, and write each board's output to its own log file with
+ * a timestamp at the start of every line.
+ *
+ * The tty is put in raw mode, so the kernel hands us the bytes
+ * as they come without echo or line editing.  We read until the
+ * tty has nothing more, and collect the output in a big buffer
+ * for each board, so the log files see a few large writes rather
+ * than one per line.  The buffers go out when they fill up, and
+ * every CAPTURE_FLUSH ms in any case so a tail -f stays current.
+ *
+ * Logs are named after the USB port path (like 1-1.2.log), which
+ * stays the same when a board resets and the ttyACM number moves.
+ * Every so often we look for ttys we don't have open yet, so a
+ * board that resets (or gets plugged in) gets picked up again.
+ *
+ * Runs until interrupted.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <termios.h>
+#include <sys/epoll.h>
+
+#include <libusb.h>
+
+#include "maple.h"
+
+extern int verbose;
+
+#define MAX_CAPTURE	64		/* same as MAX_TTYACM */
+#define CAPTURE_BUF	(1024 * 1024)	/* per board output buffer */
+#define CAPTURE_READ	(16 * 1024)
+#define CAPTURE_FLUSH	200		/* ms */
+#define CAPTURE_SCAN	1000		/* ms */
+
+/* Room left for one read with a timestamp on every line */
+#define CAPTURE_STAMP	24
+#define CAPTURE_ROOM	(CAPTURE_READ * (CAPTURE_STAMP + 1))
+
+struct capture {
+	int fd;			/* the tty, -1 if not open */
+	int log;
+	int num;		/* ttyACM number */
+	char port[32];
+	int line_start;		/* next byte starts a line */
+	char *buf;
+	int len;
+	unsigned long bytes;
+	unsigned long lines;
+};
+
+static struct capture boards[MAX_CAPTURE];
+static volatile sig_atomic_t capture_done;
+static unsigned long long capture_t0;
+
+static void
+capture_signal ( int sig )
+{
+	capture_done = 1;
+}
+
+/* The port path the tty hangs off of, from sysfs.
+ * /sys/class/tty/ttyACM0/device links to something
+ * like ../../../1-1.2:1.0, the interface on port 1-1.2
+ */
+static int
+capture_port ( int num, char *port, int len )
+{
+	char path[64];
+	char link[256];
+	char *p, *q;
+	int n;
+
+	sprintf ( path, "/sys/class/tty/ttyACM%d/device", num );
+	n = readlink ( path, link, sizeof(link) - 1 );
+	if ( n < 0 )
+	    return 1;
+	link[n] = '\0';
+
+	p = strrchr ( link, '/' );
+	p = p ? p + 1 : link;
+	q = strchr ( p, ':' );
+	if ( q )
+	    *q = '\0';
+
+	/* Too long to be a port name, let the caller use the tty */
+	n = strlen ( p );
+	if ( n >= len )
+	    return 1;
+	memcpy ( port, p, n + 1 );
+	return 0;
+}
+
+static void
+capture_flush ( struct capture *cp )
+{
+	int n;
+	int off = 0;
+
+	while ( off < cp->len ) {
+	    n = write ( cp->log, cp->buf + off, cp->len - off );
+	    if ( n < 0 ) {
+		if ( errno == EINTR )
+		    continue;
+		printf ( "Write to log for %s fails\n", cp->port );
+		break;
+	    }
+	    off += n;
+	}
+	cp->len = 0;
+}
+
+static void
+capture_close ( int efd, struct capture *cp )
+{
+	epoll_ctl ( efd, EPOLL_CTL_DEL, cp->fd, NULL );
+	close ( cp->fd );
+	cp->fd = -1;
+	capture_flush ( cp );
+	if ( verbose )
+	    printf ( "ttyACM%d (%s) went away\n", cp->num, cp->port );
+}
+
+/* Open any Maple tty we don't have yet.
+ * The log stays open when a board goes away, and picks up
+ * where it left off when the board comes back on the same port.
+ */
+static void
+capture_scan ( int efd, char *dir )
+{
+	struct epoll_event ev;
+	struct termios tio;
+	struct capture *cp;
+	char dev[32];
+	char path[256];
+	char port[32];
+	int fd;
+	int i, j;
+
+	for ( i=0; i<MAX_CAPTURE; i++ ) {
+	    sprintf ( dev, "ttyACM%d", i );
+	    for ( j=0; j<MAX_CAPTURE; j++ )
+		if ( boards[j].fd >= 0 && boards[j].num == i )
+		    break;
+	    if ( j < MAX_CAPTURE )
+		continue;
+	    if ( ! serial_is_maple ( dev ) )
+		continue;
+	    if ( capture_port ( i, port, sizeof(port) ) )
+		sprintf ( port, "%s", dev );
+
+	    /* Same port as before, or a free slot */
+	    cp = NULL;
+	    for ( j=0; j<MAX_CAPTURE; j++ ) {
+		if ( boards[j].buf && strcmp ( boards[j].port, port ) == 0 ) {
+		    cp = &boards[j];
+		    break;
+		}
+		if ( ! cp && ! boards[j].buf )
+		    cp = &boards[j];
+	    }
+	    if ( ! cp )
+		break;
+
+	    sprintf ( path, "/dev/%s", dev );
+	    fd = open ( path, O_RDONLY | O_NONBLOCK | O_NOCTTY );
+	    if ( fd < 0 )
+		continue;
+	    if ( tcgetattr ( fd, &tio ) == 0 ) {
+		cfmakeraw ( &tio );
+		tcsetattr ( fd, TCSANOW, &tio );
+	    }
+
+	    if ( ! cp->buf ) {
+		snprintf ( path, sizeof(path), "%s/%s.log", dir, port );
+		cp->log = open ( path, O_WRONLY | O_CREAT | O_APPEND, 0644 );
+		if ( cp->log < 0 ) {
+		    printf ( "Cannot open log file: %s\n", path );
+		    close ( fd );
+		    continue;
+		}
+		cp->buf = malloc ( CAPTURE_BUF );
+		if ( ! cp->buf ) {
+		    printf ( "Cannot allocate capture buffer for %s\n", port );
+		    close ( cp->log );
+		    close ( fd );
+		    continue;
+		}
+		strcpy ( cp->port, port );
+		cp->line_start = 1;
+		printf ( "Capturing %s (%s) to %s\n", path + strlen(dir) + 1, dev, path );
+	    } else if ( verbose )
+		printf ( "%s is back as %s\n", port, dev );
+
+	    cp->fd = fd;
+	    cp->num = i;
+	    ev.events = EPOLLIN;
+	    ev.data.ptr = cp;
+	    epoll_ctl ( efd, EPOLL_CTL_ADD, fd, &ev );
+	}
+}
+
+/* Copy what we read into the board's buffer,
+ * with a timestamp at the start of each line.
+ */
+static void
+capture_add ( struct capture *cp, char *data, int n )
+{
+	unsigned long long t;
+	char *p;
+	int i;
+
+	if ( cp->len + CAPTURE_ROOM > CAPTURE_BUF )
+	    capture_flush ( cp );
+
+	t = nano_time () - capture_t0;
+	p = cp->buf + cp->len;
+	for ( i=0; i<n; i++ ) {
+	    if ( cp->line_start ) {
+		p += sprintf ( p, "[%5llu.%06llu] ", t / 1000000000ULL, (t / 1000) % 1000000 );
+		cp->line_start = 0;
+	    }
+	    *p++ = data[i];
+	    if ( data[i] == '\n' ) {
+		cp->line_start = 1;
+		cp->lines++;
+	    }
+	}
+	cp->len = p - cp->buf;
+	cp->bytes += n;
+}
+
+/* Read all there is, the tty is non blocking.
+ * Returns 1 if the board went away.
+ */
+static int
+capture_read ( struct capture *cp )
+{
+	char data[CAPTURE_READ];
+	int n;
+
+	for ( ;; ) {
+	    n = read ( cp->fd, data, sizeof(data) );
+	    if ( n > 0 ) {
+		capture_add ( cp, data, n );
+		continue;
+	    }
+	    if ( n < 0 && errno == EINTR )
+		continue;
+	    if ( n < 0 && errno == EAGAIN )
+		return 0;
+	    return 1;
+	}
+}
+
+int
+capture_serial ( char *dir )
+{
+	struct epoll_event ev[MAX_CAPTURE];
+	struct capture *cp;
+	unsigned long long now;
+	unsigned long long t_flush;
+	unsigned long long t_scan;
+	int efd;
+	int n;
+	int i;
+
+	efd = epoll_create1 ( EPOLL_CLOEXEC );
+	if ( efd < 0 ) {
+	    printf ( "Cannot set up epoll\n" );
+	    return 1;
+	}
+	for ( i=0; i<MAX_CAPTURE; i++ )
+	    boards[i].fd = -1;
+
+	signal ( SIGINT, capture_signal );
+	signal ( SIGTERM, capture_signal );
+
+	capture_t0 = nano_time ();
+	capture_scan ( efd, dir );
+	t_flush = t_scan = nano_time ();
+
+	while ( ! capture_done ) {
+	    n = epoll_wait ( efd, ev, MAX_CAPTURE, CAPTURE_FLUSH );
+	    for ( i=0; i<n; i++ ) {
+		cp = (struct capture *) ev[i].data.ptr;
+		if ( capture_read ( cp ) || (ev[i].events & (EPOLLHUP | EPOLLERR)) )
+		    capture_close ( efd, cp );
+	    }
+
+	    now = nano_time ();
+	    if ( now - t_flush >= CAPTURE_FLUSH * 1000000ULL ) {
+		for ( i=0; i<MAX_CAPTURE; i++ )
+		    if ( boards[i].len )
+			capture_flush ( &boards[i] );
+		t_flush = now;
+	    }
+	    if ( now - t_scan >= CAPTURE_SCAN * 1000000ULL ) {
+		capture_scan ( efd, dir );
+		t_scan = now;
+	    }
+	}
+
+	printf ( "\n" );
+	for ( i=0; i<MAX_CAPTURE; i++ ) {
+	    cp = &boards[i];
+	    if ( ! cp->buf )
+		continue;
+	    if ( cp->fd >= 0 )
+		close ( cp->fd );
+	    capture_flush ( cp );
+	    close ( cp->log );
+	    free ( cp->buf );
+	    printf ( "%s: %lu bytes, %lu lines\n", cp->port, cp->bytes, cp->lines );
+	}
+	close ( efd );
+	return 0;
+}
+
+/* THE END */
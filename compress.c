@@ -0,0 +1,343 @@
+/* compress.c - maple-util
+ *
+ * Compressed images, image.bin.zst or image.bin.lz4, so a fixture
+ * host can keep hundreds of firmware versions without having to
+ * unpack one to a temp file to flash it.
+ *
+ * The file is read and unpacked by a thread of its own, into the
+ * image buffer, while the download is going on.  The download asks
+ * (chunk_wait) for each transfer's worth before it sends it, and
+ * the unpacking stays well ahead of the USB, so a flash takes
+ * no longer than it would from a raw binary.  Anything that wants
+ * the whole image at once (verify, audit, the cache) waits for all
+ * of it with file_wait().
+ *
+ * We need the image size before we start, for the checks and the
+ * progress bar, so the frame header must give it.  zstd does that
+ * by default, lz4 wants "lz4 --content-size".
+ *
+ * Both are optional, build with "make ZSTD=1 LZ4=1" to get them,
+ * which needs libzstd and liblz4.  There is no DFU suffix on a
+ * compressed image, we don't look for one.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include <libusb.h>
+
+#include "maple.h"
+#include "hash.h"
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+#define FMT_ZSTD	1
+#define FMT_LZ4		2
+
+#define COMPRESS_READ	(16 * 1024)	/* bytes of packed file at a time */
+#define COMPRESS_HEAD	32		/* enough for either frame header */
+#define COMPRESS_MAX	(1024 * 1024)	/* more than any flash we know */
+
+struct chunk_src {
+	struct dfu_file *fp;
+	int fmt;
+	int fd;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int avail;		/* bytes of image ready */
+	int failed;
+	int nin;		/* bytes in inbuf */
+	unsigned char inbuf[COMPRESS_READ];
+};
+
+/* What sort of file is this, by the name.  0 if not compressed.
+ */
+int
+compress_format ( char *name )
+{
+	char *ext;
+
+	ext = strrchr ( name, '.' );
+	if ( ! ext )
+	    return 0;
+	if ( strcasecmp ( ext, ".zst" ) == 0 )
+	    return FMT_ZSTD;
+	if ( strcasecmp ( ext, ".lz4" ) == 0 )
+	    return FMT_LZ4;
+	return 0;
+}
+
+/* Tell the download how far we have got */
+static void
+chunk_publish ( struct chunk_src *sp, int avail, int failed )
+{
+	pthread_mutex_lock ( &sp->lock );
+	sp->avail = avail;
+	sp->failed = failed;
+	pthread_cond_broadcast ( &sp->cond );
+	pthread_mutex_unlock ( &sp->lock );
+}
+
+static int
+chunk_fill ( struct chunk_src *sp )
+{
+	sp->nin = read ( sp->fd, sp->inbuf, COMPRESS_READ );
+	return sp->nin;
+}
+
+#ifdef HAVE_ZSTD
+static int
+zstd_size ( struct chunk_src *sp )
+{
+	unsigned long long n = ZSTD_getFrameContentSize ( sp->inbuf, sp->nin );
+
+	if ( n == ZSTD_CONTENTSIZE_ERROR )
+	    return -1;
+	if ( n == ZSTD_CONTENTSIZE_UNKNOWN || n > COMPRESS_MAX )
+	    return -2;
+	return n;
+}
+
+/* Returns 0 if the whole image came out */
+static int
+zstd_unpack ( struct chunk_src *sp )
+{
+	struct dfu_file *fp = sp->fp;
+	ZSTD_DStream *zd;
+	ZSTD_inBuffer in;
+	ZSTD_outBuffer out;
+	size_t rv = 1;
+
+	zd = ZSTD_createDStream ();
+	if ( ! zd )
+	    return 1;
+	ZSTD_initDStream ( zd );
+
+	out.dst = fp->buf;
+	out.size = fp->size;
+	out.pos = 0;
+
+	do {
+	    in.src = sp->inbuf;
+	    in.size = sp->nin;
+	    in.pos = 0;
+	    while ( in.pos < in.size ) {
+		rv = ZSTD_decompressStream ( zd, &out, &in );
+		if ( ZSTD_isError ( rv ) || (out.pos == out.size && in.pos < in.size && rv) )
+		    goto done;
+		chunk_publish ( sp, out.pos, 0 );
+	    }
+	} while ( rv && chunk_fill ( sp ) > 0 );
+
+done:
+	ZSTD_freeDStream ( zd );
+	return ZSTD_isError ( rv ) || rv != 0 || out.pos != fp->size;
+}
+#endif
+
+#ifdef HAVE_LZ4
+static int
+lz4_size ( struct chunk_src *sp )
+{
+	LZ4F_dctx *dctx;
+	LZ4F_frameInfo_t info;
+	size_t n = sp->nin;
+	size_t rv;
+
+	if ( LZ4F_isError ( LZ4F_createDecompressionContext ( &dctx, LZ4F_VERSION ) ) )
+	    return -1;
+	rv = LZ4F_getFrameInfo ( dctx, &info, sp->inbuf, &n );
+	LZ4F_freeDecompressionContext ( dctx );
+	if ( LZ4F_isError ( rv ) )
+	    return -1;
+	if ( info.contentSize == 0 || info.contentSize > COMPRESS_MAX )
+	    return -2;
+	return info.contentSize;
+}
+
+static int
+lz4_unpack ( struct chunk_src *sp )
+{
+	struct dfu_file *fp = sp->fp;
+	LZ4F_dctx *dctx;
+	size_t dst, src;
+	size_t rv = 1;
+	int pos = 0;
+	int off;
+
+	if ( LZ4F_isError ( LZ4F_createDecompressionContext ( &dctx, LZ4F_VERSION ) ) )
+	    return 1;
+
+	do {
+	    off = 0;
+	    while ( off < sp->nin ) {
+		dst = fp->size - pos;
+		src = sp->nin - off;
+		rv = LZ4F_decompress ( dctx, fp->buf + pos, &dst, sp->inbuf + off, &src, NULL );
+		if ( LZ4F_isError ( rv ) || (dst == 0 && src == 0) )
+		    goto done;
+		pos += dst;
+		off += src;
+		chunk_publish ( sp, pos, 0 );
+	    }
+	} while ( rv && chunk_fill ( sp ) > 0 );
+
+done:
+	LZ4F_freeDecompressionContext ( dctx );
+	return LZ4F_isError ( rv ) || rv != 0 || pos != fp->size;
+}
+#endif
+
+static void *
+chunk_worker ( void *arg )
+{
+	struct chunk_src *sp = arg;
+	struct dfu_file *fp = sp->fp;
+	int bad = 1;
+
+#ifdef HAVE_ZSTD
+	if ( sp->fmt == FMT_ZSTD )
+	    bad = zstd_unpack ( sp );
+#endif
+#ifdef HAVE_LZ4
+	if ( sp->fmt == FMT_LZ4 )
+	    bad = lz4_unpack ( sp );
+#endif
+	close ( sp->fd );
+	sp->fd = -1;
+
+	if ( bad ) {
+	    printf ( "%s: bad compressed data\n", fp->name );
+	    chunk_publish ( sp, sp->avail, 1 );
+	} else {
+	    fp->digest = hash_buf ( fp->buf, fp->size );
+	    chunk_publish ( sp, fp->size, 0 );
+	}
+	return NULL;
+}
+
+/* Get the size from the frame header, then leave the
+ * rest to the worker.  Returns 0 if it looks good.
+ */
+int
+compress_read ( struct dfu_file *fp )
+{
+	struct chunk_src *sp;
+	int fmt = compress_format ( fp->name );
+	int size = -1;
+
+#ifndef HAVE_ZSTD
+	if ( fmt == FMT_ZSTD ) {
+	    printf ( "%s: built without zstd, make ZSTD=1\n", fp->name );
+	    return 1;
+	}
+#endif
+#ifndef HAVE_LZ4
+	if ( fmt == FMT_LZ4 ) {
+	    printf ( "%s: built without lz4, make LZ4=1\n", fp->name );
+	    return 1;
+	}
+#endif
+
+	sp = malloc ( sizeof(*sp) );
+	if ( ! sp )
+	    return 1;
+	memset ( sp, 0, sizeof(*sp) );
+	sp->fp = fp;
+	sp->fmt = fmt;
+	sp->fd = open ( fp->name, O_RDONLY );
+	if ( sp->fd < 0 || chunk_fill ( sp ) < COMPRESS_HEAD / 4 ) {
+	    if ( sp->fd >= 0 )
+		close ( sp->fd );
+	    free ( sp );
+	    return 1;
+	}
+
+#ifdef HAVE_ZSTD
+	if ( fmt == FMT_ZSTD )
+	    size = zstd_size ( sp );
+#endif
+#ifdef HAVE_LZ4
+	if ( fmt == FMT_LZ4 )
+	    size = lz4_size ( sp );
+#endif
+	if ( size < 0 ) {
+	    if ( size == -2 )
+		printf ( "%s: the frame header must give the size (lz4 --content-size)\n", fp->name );
+	    else
+		printf ( "%s: not a %s file\n", fp->name, fmt == FMT_ZSTD ? "zstd" : "lz4" );
+	    close ( sp->fd );
+	    free ( sp );
+	    return 1;
+	}
+
+	fp->size = size;
+	fp->buf = malloc ( size ? size : 1 );
+	if ( ! fp->buf ) {
+	    close ( sp->fd );
+	    free ( sp );
+	    return 1;
+	}
+
+	pthread_mutex_init ( &sp->lock, NULL );
+	pthread_cond_init ( &sp->cond, NULL );
+	fp->src = sp;
+	pthread_create ( &sp->thread, NULL, chunk_worker, sp );
+
+	/* The vector table, for image_check() */
+	return chunk_wait ( fp, size < 64 ? size : 64 );
+}
+
+/* Wait until the first n bytes of the image are there.
+ * Returns 0 when they are, 1 if they never will be.
+ */
+int
+chunk_wait ( struct dfu_file *fp, int n )
+{
+	struct chunk_src *sp = fp->src;
+	int rv;
+
+	if ( ! sp )
+	    return 0;
+
+	pthread_mutex_lock ( &sp->lock );
+	while ( sp->avail < n && ! sp->failed )
+	    pthread_cond_wait ( &sp->cond, &sp->lock );
+	rv = sp->avail < n;
+	pthread_mutex_unlock ( &sp->lock );
+	return rv;
+}
+
+int
+file_wait ( struct dfu_file *fp )
+{
+	return chunk_wait ( fp, fp->size );
+}
+
+/* From put_file(), the image buffer is freed there */
+void
+compress_done ( struct dfu_file *fp )
+{
+	struct chunk_src *sp = fp->src;
+
+	if ( ! sp )
+	    return;
+	pthread_join ( sp->thread, NULL );
+	pthread_mutex_destroy ( &sp->lock );
+	pthread_cond_destroy ( &sp->cond );
+	free ( sp );
+	fp->src = NULL;
+}
+
+/* THE END */
@@ -28,18 +28,163 @@ void milli_sleep ( int );
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <libusb.h>
 
 #include "maple.h"
 #include "dfu.h"
+#include "trace.h"
+#include "hist.h"
 
 #ifndef TJT
 #include "portable.h"
 #include "quirks.h"
 #endif
 
-static int dfu_timeout = 5000;  /* 5 seconds - default */
+/* tjt - deadlines.  Rather than give every request the profile
+ * timeout (5 seconds), each kind of request gets a deadline from
+ * what we have seen of it on this board: DEADLINE_MULT times the
+ * slowest recent one, and never less than DEADLINE_MIN.  GETSTATUS
+ * also gets the last bwPollTimeout, since some loaders program the
+ * flash before they answer.  Until we have seen DEADLINE_LEARN of a
+ * request, and always as the ceiling, the profile timeout applies.
+ * A wedged board is then found out in tens of ms, not seconds.
+ *
+ * On top of that a job (one board, from maple_open on) can have a
+ * time budget.  No request gets more than what is left of it, and
+ * once it is gone every request (but DETACH) fails at once with a
+ * timeout, so the caller gives up on the board and resets it.
+ *
+ * All per thread, each board has its own.
+ */
+#define DEADLINE_MIN	20	/* ms */
+#define DEADLINE_MULT	4
+#define DEADLINE_LEARN	4
+#define DEADLINE_NREQ	7	/* DETACH through ABORT */
+
+struct dfu_deadline {
+    int count;
+    unsigned int slow_us;	/* slowest recent, decays by 1/8 each time */
+};
+
+static __thread int dfu_timeout = 5000;  /* 5 seconds - default */
+static __thread struct dfu_deadline dfu_deadlines[DEADLINE_NREQ];
+static __thread unsigned int dfu_poll_hint;	/* last bwPollTimeout, ms */
+static __thread unsigned long long dfu_budget_end;
+static __thread int dfu_budget_gone;
+
+void dfu_set_timeout( int timeout )
+{
+    dfu_timeout = timeout;
+}
+
+/* A different sort of board, forget what we learned about the last one */
+void dfu_forget_deadlines( void )
+{
+    memset( dfu_deadlines, 0, sizeof(dfu_deadlines) );
+    dfu_poll_hint = 0;
+}
+
+void dfu_set_budget( int budget )
+{
+    dfu_budget_end = budget ? nano_time() + budget * 1000000ULL : 0;
+    dfu_budget_gone = 0;
+}
+
+static unsigned int dfu_deadline( unsigned char bRequest )
+{
+    struct dfu_deadline *dp;
+    unsigned int ms;
+
+    if( bRequest >= DEADLINE_NREQ )
+        return dfu_timeout;
+    dp = &dfu_deadlines[bRequest];
+    if( dp->count < DEADLINE_LEARN )
+        return dfu_timeout;
+
+    ms = DEADLINE_MULT * dp->slow_us / 1000 + 1;
+    if( ms < DEADLINE_MIN )
+        ms = DEADLINE_MIN;
+    if( bRequest == DFU_GETSTATUS )
+        ms += dfu_poll_hint;
+    if( ms > dfu_timeout )
+        ms = dfu_timeout;
+    return ms;
+}
+
+static void dfu_learn( unsigned char bRequest, unsigned long long ns )
+{
+    struct dfu_deadline *dp;
+    unsigned int us = ns / 1000;
+
+    if( bRequest >= DEADLINE_NREQ )
+        return;
+    dp = &dfu_deadlines[bRequest];
+    dp->slow_us -= dp->slow_us / 8;
+    if( us > dp->slow_us )
+        dp->slow_us = us;
+    dp->count++;
+}
+
+int (*dfu_xfer_hook) ( libusb_device_handle *, struct dfu_xfer * ) = NULL;
+
+/* tjt - every request below funnels through here, so this
+ * is the one place to trace transfers or divert them to a
+ * simulated device.
+ */
+static int dfu_control( libusb_device_handle *device,
+                        unsigned char bmRequestType,
+                        unsigned char bRequest,
+                        unsigned short wValue,
+                        unsigned short wIndex,
+                        unsigned char *data,
+                        unsigned short wLength )
+{
+    struct dfu_xfer xfer;
+    unsigned long long t0, t1;
+    int result;
+
+    xfer.bmRequestType = bmRequestType;
+    xfer.bRequest      = bRequest;
+    xfer.wValue        = wValue;
+    xfer.wIndex        = wIndex;
+    xfer.wLength       = wLength;
+    xfer.data          = data;
+    xfer.timeout       = dfu_deadline( bRequest );
+
+    t0 = nano_time();
+
+    /* tjt - the DETACH is how a board we gave up on gets reset, let it through */
+    if( dfu_budget_end && bRequest != DFU_DETACH ) {
+        if( t0 >= dfu_budget_end ) {
+            if( ! dfu_budget_gone++ )
+                printf( "Time budget for this board is used up\n" );
+            return LIBUSB_ERROR_TIMEOUT;
+        }
+        if( xfer.timeout > (dfu_budget_end - t0) / 1000000 + 1 )
+            xfer.timeout = (dfu_budget_end - t0) / 1000000 + 1;
+    }
+
+    if( dfu_xfer_hook )
+        result = (*dfu_xfer_hook)( device, &xfer );
+    else
+        result = libusb_control_transfer( device, bmRequestType, bRequest,
+                    wValue, wIndex, data, wLength, xfer.timeout );
+
+    t1 = nano_time();
+    if( result >= 0 )
+        dfu_learn( bRequest, t1 - t0 );
+
+    if( trace_active )
+        trace_record( &xfer, result, t0, t1 );
+    if( hist_active )
+        hist_record( device, bRequest, t1 - t0, result );
+    if( timeline_active )
+        timeline_span( dfu_request_to_string( bRequest ), t0, t1 );
+
+    return result;
+}
 
 /*
  *  DFU_DETACH Request (DFU Spec 1.0, Section 5.1)
@@ -55,14 +200,13 @@ int dfu_detach( libusb_device_handle *device,
                 const unsigned short interface,
                 const unsigned short timeout )
 {
-    return libusb_control_transfer( device,
+    return dfu_control( device,
         /* bmRequestType */ LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
         /* bRequest      */ DFU_DETACH,
         /* wValue        */ timeout,
         /* wIndex        */ interface,
         /* Data          */ NULL,
-        /* wLength       */ 0,
-                            dfu_timeout );
+        /* wLength       */ 0 );
 }
 
 
@@ -85,14 +229,13 @@ int dfu_download( libusb_device_handle *device,
 {
     int status;
 
-    status = libusb_control_transfer( device,
+    status = dfu_control( device,
           /* bmRequestType */ LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
           /* bRequest      */ DFU_DNLOAD,
           /* wValue        */ transaction,
           /* wIndex        */ interface,
           /* Data          */ data,
-          /* wLength       */ length,
-                              dfu_timeout );
+          /* wLength       */ length );
     return status;
 }
 
@@ -116,14 +259,13 @@ int dfu_upload( libusb_device_handle *device,
 {
     int status;
 
-    status = libusb_control_transfer( device,
+    status = dfu_control( device,
           /* bmRequestType */ LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
           /* bRequest      */ DFU_UPLOAD,
           /* wValue        */ transaction,
           /* wIndex        */ interface,
           /* Data          */ data,
-          /* wLength       */ length,
-                              dfu_timeout );
+          /* wLength       */ length );
     return status;
 }
 
@@ -150,28 +292,33 @@ dfu_get_status ( struct maple_device *mp, struct dfu_status *status )
     status->bState        = STATE_DFU_ERROR;
     status->iString       = 0;
 
-    result = libusb_control_transfer( mp->devh,
+    result = dfu_control( mp->devh,
           /* bmRequestType */ LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
           /* bRequest      */ DFU_GETSTATUS,
           /* wValue        */ 0,
           /* wIndex        */ mp->interface,
           /* Data          */ buffer,
-          /* wLength       */ 6,
-                              dfu_timeout );
+          /* wLength       */ 6 );
 
     if( 6 == result ) {
         status->bStatus = buffer[0];
-#ifndef TJT
-        if (dif->quirks & QUIRK_POLLTIMEOUT)
-            status->bwPollTimeout = DEFAULT_POLLTIMEOUT;
+        /* tjt - QUIRK_POLLTIMEOUT comes from the device profile */
+        if (mp->prof && mp->prof->poll_timeout >= 0)
+            status->bwPollTimeout = mp->prof->poll_timeout;
         else
-#endif
             status->bwPollTimeout = ((0xff & buffer[3]) << 16) |
                                     ((0xff & buffer[2]) << 8)  |
                                     (0xff & buffer[1]);
         status->bState  = buffer[4];
         status->iString = buffer[5];
-    }
+        /* tjt - what the device says, whatever the profile poll is */
+        dfu_poll_hint = ((0xff & buffer[3]) << 16) | ((0xff & buffer[2]) << 8) | (0xff & buffer[1]);
+        /* tjt - keep count for the history, and the status board current */
+        mp->polls++;
+        mp->last_status = status->bStatus;
+        status_state( mp, status->bState, status->bStatus );
+    } else
+        status_error( mp, "GETSTATUS failed" );
 
     return result;
 }
@@ -188,14 +335,13 @@ dfu_get_status ( struct maple_device *mp, struct dfu_status *status )
 int dfu_clear_status( libusb_device_handle *device,
                       const unsigned short interface )
 {
-    return libusb_control_transfer( device,
+    return dfu_control( device,
         /* bmRequestType */ LIBUSB_ENDPOINT_OUT| LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
         /* bRequest      */ DFU_CLRSTATUS,
         /* wValue        */ 0,
         /* wIndex        */ interface,
         /* Data          */ NULL,
-        /* wLength       */ 0,
-                            dfu_timeout );
+        /* wLength       */ 0 );
 }
 
 
@@ -216,14 +362,13 @@ int dfu_get_state( libusb_device_handle *device,
     int result;
     unsigned char buffer[1];
 
-    result = libusb_control_transfer( device,
+    result = dfu_control( device,
           /* bmRequestType */ LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
           /* bRequest      */ DFU_GETSTATE,
           /* wValue        */ 0,
           /* wIndex        */ interface,
           /* Data          */ buffer,
-          /* wLength       */ 1,
-                              dfu_timeout );
+          /* wLength       */ 1 );
 
     /* Return the error if there is one. */
     if (result < 1)
@@ -245,14 +390,13 @@ int dfu_get_state( libusb_device_handle *device,
 int dfu_abort( libusb_device_handle *device,
                const unsigned short interface )
 {
-    return libusb_control_transfer( device,
+    return dfu_control( device,
         /* bmRequestType */ LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
         /* bRequest      */ DFU_ABORT,
         /* wValue        */ 0,
         /* wIndex        */ interface,
         /* Data          */ NULL,
-        /* wLength       */ 0,
-                            dfu_timeout );
+        /* wLength       */ 0 );
 }
 
 
@@ -302,6 +446,19 @@ const char* dfu_state_to_string( int state )
     return message;
 }
 
+/* Table 3.2 */
+static const char *dfu_request_names[] = {
+	"DETACH", "DNLOAD", "UPLOAD", "GETSTATUS",
+	"CLRSTATUS", "GETSTATE", "ABORT"
+};
+
+const char *dfu_request_to_string( int request )
+{
+	if (request < 0 || request > DFU_ABORT)
+		return "INVALID";
+	return dfu_request_names[request];
+}
+
 /* Chapter 6.1.2 */
 static const char *dfu_status_names[] = {
 	/* DFU_STATUS_OK */
@@ -346,32 +503,34 @@ const char *dfu_status_to_string(int status)
 	return dfu_status_names[status];
 }
 
-#ifdef notdef /* TJT */
-int dfu_abort_to_idle(struct dfu_if *dif)
+/* tjt - errx() calls are now returns, since a session
+ * wants to carry on (or at least reset the board) afterwards.
+ */
+// int dfu_abort_to_idle(struct dfu_if *dif)
+int dfu_abort_to_idle(struct maple_device *mp)
 {
 	int ret;
 	struct dfu_status dst;
 
-	ret = dfu_abort(dif->dev_handle, dif->interface);
+	ret = dfu_abort(mp->devh, mp->interface);
 	if (ret < 0) {
 		// errx(EX_IOERR, "Error sending dfu abort request");
-		printf("Error sending dfu abort request");
-		exit(1);
+		printf("Error sending dfu abort request\n");
+		return ret;
 	}
-	ret = dfu_get_status(dif, &dst);
+	ret = dfu_get_status(mp, &dst);
 	if (ret < 0) {
 		// errx(EX_IOERR, "Error during abort get_status");
-		printf("Error during abort get_status");
-		exit(1);
+		printf("Error during abort get_status\n");
+		return ret;
 	}
 	if (dst.bState != DFU_STATE_dfuIDLE) {
 		// errx(EX_IOERR, "Failed to enter idle state on abort");
-		printf("Failed to enter idle state on abort");
-		exit(1);
+		printf("Failed to enter idle state on abort\n");
+		return -1;
 	}
 	milli_sleep(dst.bwPollTimeout);
 	return ret;
 }
-#endif
 
 /* THE END */
@@ -103,10 +103,34 @@ struct dfu_if {
     libusb_device_handle *dev_handle;
     struct dfu_if *next;
 };
-
-int dfu_abort_to_idle( struct dfu_if *dif);
 #endif
 
+// int dfu_abort_to_idle( struct dfu_if *dif);
+int dfu_abort_to_idle( struct maple_device *mp );
+
+/* One control transfer, as handed to the transfer hook below.
+ * Every request in dfu.c is built into one of these before it
+ * goes out, so the trace and simulation code see them all.
+ */
+struct dfu_xfer {
+    unsigned char  bmRequestType;
+    unsigned char  bRequest;
+    unsigned short wValue;
+    unsigned short wIndex;
+    unsigned short wLength;
+    unsigned char *data;
+    unsigned int   timeout;	/* tjt - ms, the deadline for this one */
+};
+
+/* When set, transfers go here instead of to libusb.
+ * This is how a simulated (or replayed) device gets plugged in.
+ */
+extern int (*dfu_xfer_hook) ( libusb_device_handle *, struct dfu_xfer * );
+
+void dfu_set_timeout( int timeout );
+void dfu_set_budget( int budget );
+void dfu_forget_deadlines( void );
+
 int dfu_detach( libusb_device_handle *device,
                 const unsigned short interface,
                 const unsigned short timeout );
@@ -136,6 +160,8 @@ int dfu_abort( libusb_device_handle *device,
 
 const char *dfu_state_to_string( int state );
 
+const char *dfu_request_to_string( int request );
+
 const char *dfu_status_to_string( int status );
 
 #endif /* DFU_H */
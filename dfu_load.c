@@ -35,11 +35,15 @@ void milli_sleep ( int );
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include <libusb.h>
 
 #include "maple.h"
 #include "dfu.h"
+#include "hist.h"
+#include "hash.h"
 
 #ifndef TJT
 #include "portable.h"
@@ -50,6 +54,12 @@ void milli_sleep ( int );
 #endif
 
 extern int verbose;
+extern int show_progress;
+
+/* tjt - a manifestation tolerant loader gets this many
+ * GETSTATUS polls to get back to dfuIDLE.
+ */
+#define MANIFEST_POLLS	50
 
 static void dfu_progress_bar ( const char *, unsigned long, unsigned long );
 
@@ -61,19 +71,22 @@ dfuload_do_dnload (struct maple_device *mp, struct dfu_file *file)
 	int expected_size;
 	unsigned char *buf;
 	unsigned short transaction = 0;
+	unsigned long long t_manifest = 0;
 	struct dfu_status dst;
+	int polls;
 	int ret;
 	int xfer_size = mp->xfer_size;
 
 	// printf("Copying data from PC to DFU device\n");
-	printf ( "Downloading %d bytes from %s\n", file->size, file->name );
+	if (show_progress)
+		printf ( "Downloading %d bytes from %s\n", file->size, file->name );
 
-	buf = file->buf;
 	//expected_size = file->size.total - file->size.suffix;
 	expected_size = file->size;
 	bytes_sent = 0;
 
 	dfu_progress_bar("Download", 0, 1);
+	status_start(mp, expected_size);
 
 	while (bytes_sent < expected_size) {
 		int bytes_left;
@@ -85,6 +98,14 @@ dfuload_do_dnload (struct maple_device *mp, struct dfu_file *file)
 		else
 			chunk_size = xfer_size;
 
+		/* tjt - a compressed image may still be unpacking */
+		if (chunk_wait(file, bytes_sent + chunk_size)) {
+			status_error(mp, "bad image");
+			goto out;
+		}
+		/* tjt - with this board's own bytes, if any (see patch.c) */
+		buf = (unsigned char *) patch_chunk(mp, file, bytes_sent, chunk_size);
+
 		// ret = dfu_download(dif->dev_handle, dif->interface,
 		// printf ( "Sending %d bytes\n", chunk_size );
 		ret = dfu_download ( mp->devh, mp->interface,
@@ -94,10 +115,10 @@ dfuload_do_dnload (struct maple_device *mp, struct dfu_file *file)
 		if (ret < 0) {
 			// warnx("Error during download");
 			printf("Error during download\n");
+			status_error(mp, "download failed");
 			goto out;
 		}
 		bytes_sent += chunk_size;
-		buf += chunk_size;
 
 		do {
 			// ret = dfu_get_status(dif, &dst);
@@ -119,7 +140,14 @@ dfuload_do_dnload (struct maple_device *mp, struct dfu_file *file)
 				break;
 
 			/* Wait while device executes flashing */
-			milli_sleep(dst.bwPollTimeout);
+			if (hist_active) {
+				unsigned long long t0 = nano_time();
+
+				milli_sleep(dst.bwPollTimeout);
+				hist_record(mp->devh, HIST_POLL_WAIT,
+				    nano_time() - t0, 0);
+			} else
+				milli_sleep(dst.bwPollTimeout);
 
 		} while (1);
 
@@ -128,16 +156,21 @@ dfuload_do_dnload (struct maple_device *mp, struct dfu_file *file)
 			printf("state(%u) = %s, status(%u) = %s\n", dst.bState,
 				dfu_state_to_string(dst.bState), dst.bStatus,
 				dfu_status_to_string(dst.bStatus));
+			/* tjt - that block did not make it */
+			bytes_sent -= chunk_size;
 			ret = -1;
 			goto out;
 		}
 
 		//dfu_progress_bar("Download", bytes_sent, bytes_sent + bytes_left);
 		dfu_progress_bar("Download", bytes_sent, expected_size );
+		status_bytes(mp, bytes_sent);
 	}
 
 	/* send one zero sized download request to signalize end */
 	// printf ( "Sending zero size packet\n" );
+	t_manifest = nano_time();
+	mp->t_manifest = t_manifest;
 	ret = dfu_download(mp->devh, mp->interface,
 	    0, transaction, NULL);
 	// reports "0"
@@ -155,16 +188,32 @@ dfuload_do_dnload (struct maple_device *mp, struct dfu_file *file)
 	if (verbose)
 		printf("Sent a total of %i bytes\n", bytes_sent);
 
-get_status:
-	/* Transition to MANIFEST_SYNC state */
-	// printf ( "Ask for status\n" );
-	ret = dfu_get_status ( mp, &dst);
-	// returns 6
-	// printf ( " - status response: %d\n", ret );
-	if (ret < 0) {
-		// warnx("unable to read DFU status after completion");
-		printf("unable to read DFU status after completion\n");
-		goto out;
+	/* tjt - what comes next depends on bitManifestationTolerant.
+	 * A tolerant loader goes through dfuMANIFEST and back to dfuIDLE,
+	 * and we poll it there, waiting what bwPollTimeout says each time.
+	 * One that isn't (the Maple) ends in dfuMANIFEST-WAIT-RESET and
+	 * won't talk any more, so once it is manifesting we just sit out
+	 * its bwPollTimeout and leave the rest to perform_reset().
+	 * There is no fixed 1 second wait here like dfu-util has.
+	 */
+	for (polls = 0; polls < MANIFEST_POLLS; polls++) {
+		ret = dfu_get_status ( mp, &dst);
+		if (ret < 0) {
+			// warnx("unable to read DFU status after completion");
+			printf("unable to read DFU status after completion\n");
+			goto out;
+		}
+		mp->manifest_state = dst.bState;
+
+		if (dst.bState != DFU_STATE_dfuMANIFEST_SYNC &&
+		    dst.bState != DFU_STATE_dfuMANIFEST)
+			break;
+		milli_sleep(dst.bwPollTimeout);
+		if (dst.bState == DFU_STATE_dfuMANIFEST &&
+		    mp->dfu_attr >= 0 && !(mp->dfu_attr & USB_DFU_MANIFEST_TOL)) {
+			mp->manifest_state = DFU_STATE_dfuMANIFEST_WAIT_RST;
+			break;
+		}
 	}
 
 	/* I see here:
@@ -172,88 +221,281 @@ get_status:
 	status(0) = No error condition is present
 	(nothing here I find particularly interesting)
 	 */
-	// printf("state(%u) = %s\n", dst.bState, dfu_state_to_string(dst.bState) );
-	// printf("status(%u) = %s\n", dst.bStatus, dfu_status_to_string(dst.bStatus) );
-
-#ifdef notdef
-	milli_sleep(dst.bwPollTimeout);
-
-	/* FIXME: deal correctly with ManifestationTolerant=0 / WillDetach bits */
-	switch (dst.bState) {
-	case DFU_STATE_dfuMANIFEST_SYNC:
-	case DFU_STATE_dfuMANIFEST:
-		/* some devices (e.g. TAS1020b) need some time before we
-		 * can obtain the status */
-		milli_sleep(1000);
-		goto get_status;
-		break;
-	case DFU_STATE_dfuIDLE:
-		break;
+	if (verbose)
+		printf("Manifest done, state(%u) = %s\n", mp->manifest_state,
+		    dfu_state_to_string(mp->manifest_state));
+	if (dst.bState == DFU_STATE_dfuERROR) {
+		printf("Manifestation failed: %s\n", dfu_status_to_string(dst.bStatus));
+		bytes_sent = -1;
 	}
-#endif
-	// printf( " Download done!\n" );
 
 out:
+	/* tjt - from the zero length block to the end, for the timeline */
+	if (t_manifest)
+		timeline_span("manifest", t_manifest, nano_time());
 	return bytes_sent;
 }
 
-#ifndef TJT
-int dfuload_do_upload(struct dfu_if *dif, int xfer_size,
-    int expected_size, int fd)
+/* tjt - like dfuload_do_upload() below, but into a buffer in memory.
+ * We stop at a short block (the device has no more to give)
+ * or when the buffer is full, whichever comes first.
+ * If we stop because the buffer is full, the device is left
+ * in dfuUPLOAD-IDLE, and the caller needs to abort to get it idle.
+ * Returns the number of bytes received or < 0 on error.
+ */
+int
+dfuload_do_upload_buf (struct maple_device *mp, unsigned char *buf, int max_size)
 {
 	int total_bytes = 0;
 	unsigned short transaction = 0;
+	int xfer_size = mp->xfer_size;
+	int chunk_size;
+	int rc;
+
+	/* tjt - the STM32 ROM loader wants an address first */
+	if (mp->prof->proto == PROTO_DFUSE) {
+		rc = dfuse_upload_start(mp);
+		if (rc < 0)
+			return rc;
+		transaction = rc;
+	}
+
+	dfu_progress_bar("Upload", 0, 1);
+
+	while (total_bytes < max_size) {
+		chunk_size = max_size - total_bytes;
+		if (chunk_size > xfer_size)
+			chunk_size = xfer_size;
+
+		rc = dfu_upload(mp->devh, mp->interface,
+		    chunk_size, transaction++, buf + total_bytes);
+		if (rc < 0) {
+			printf("Error during upload\n");
+			return rc;
+		}
+		total_bytes += rc;
+
+		if (rc < chunk_size) {
+			/* last block, return */
+			break;
+		}
+		dfu_progress_bar("Upload", total_bytes, max_size);
+	}
+
+	dfu_progress_bar("Upload", total_bytes, total_bytes);
+	if (verbose)
+		printf("Received a total of %i bytes\n", total_bytes);
+	return total_bytes;
+}
+
+/* tjt - The dfu-util version of this wrote each block with
+ * dfu_file_write_crc() before asking for the next one.
+ * Here the device and the disk take turns with two buffers:
+ * while a writer thread puts one block on disk (and hashes it,
+ * and notes whether it is erased flash), we are already
+ * getting the next block over USB.
+ */
+struct upload_pipe {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned char *buf[2];
+	int len[2];		/* bytes waiting in each buffer, 0 if free */
+	int done;		/* no more blocks coming */
+	int error;
+	int fd;
+	struct dfu_dump *dump;
+};
+
+/* Note one block in the run list, merging it with the
+ * last run if it is the same kind.
+ */
+static void
+dump_note_block(struct dfu_dump *dump, int len, int erased)
+{
+	struct dfu_dump_run *rp = NULL;
+
+	if (dump->nrun)
+		rp = &dump->run[dump->nrun - 1];
+	if (!rp || rp->erased != erased) {
+		if (dump->nrun < DUMP_MAX_RUNS) {
+			rp = &dump->run[dump->nrun++];
+			rp->start = dump->total;
+			rp->len = 0;
+			rp->erased = erased;
+		} else {
+			/* out of room, lump it in with the last run */
+			rp->erased = 0;
+		}
+	}
+	rp->len += len;
+	dump->total += len;
+	if (erased)
+		dump->erased += len;
+}
+
+static void *
+upload_writer(void *arg)
+{
+	struct upload_pipe *pp = arg;
+	struct dfu_dump *dump = pp->dump;
 	unsigned char *buf;
-	int ret;
+	int which = 0;
+	int len;
+	int i;
+
+	for (;;) {
+		pthread_mutex_lock(&pp->lock);
+		while (pp->len[which] == 0 && !pp->done)
+			pthread_cond_wait(&pp->cond, &pp->lock);
+		len = pp->len[which];
+		pthread_mutex_unlock(&pp->lock);
+		if (len == 0)
+			break;
 
-	buf = dfu_malloc(xfer_size);
+		buf = pp->buf[which];
+		if (pp->fd >= 0 && !pp->error && write(pp->fd, buf, len) != len)
+			pp->error = 1;
+		dump->hash = hash_update(dump->hash, buf, len);
+		if (dump->block_hash && dump->nblocks < dump->max_blocks)
+			dump->block_hash[dump->nblocks++] = hash_buf(buf, len);
+		for (i = 0; i < len && buf[i] == 0xff; i++)
+			;
+		dump_note_block(dump, len, i == len);
+
+		pthread_mutex_lock(&pp->lock);
+		pp->len[which] = 0;
+		pthread_cond_signal(&pp->cond);
+		pthread_mutex_unlock(&pp->lock);
+		which ^= 1;
+	}
+	return NULL;
+}
 
-	printf("Copying data from DFU device to PC\n");
-	//dfu_progress_bar("Upload", 0, 1);
+/* Read flash to fd (which may be -1 if we just want the summary)
+ * until a short block, or until expected_size if that is not 0.
+ * Returns the number of bytes received or < 0 on error.
+ */
+// int dfuload_do_upload(struct dfu_if *dif, int xfer_size,
+//     int expected_size, int fd)
+int
+dfuload_do_upload(struct maple_device *mp, int expected_size, int fd,
+    struct dfu_dump *dump)
+{
+	struct upload_pipe pipe;
+	pthread_t writer;
+	unsigned short transaction = 0;
+	int xfer_size = mp->xfer_size;
+	int total_bytes = 0;
+	int which = 0;
+	int ret = 0;
+	int rc;
+	int chunk_size;
+
+	dump->total = 0;
+	dump->erased = 0;
+	dump->hash = HASH_INIT;
+	dump->nrun = 0;
+	dump->nblocks = 0;
+
+	memset(&pipe, 0, sizeof(pipe));
+	pthread_mutex_init(&pipe.lock, NULL);
+	pthread_cond_init(&pipe.cond, NULL);
+	pipe.fd = fd;
+	pipe.dump = dump;
+	pipe.buf[0] = malloc(xfer_size);
+	pipe.buf[1] = malloc(xfer_size);
+	if (!pipe.buf[0] || !pipe.buf[1]) {
+		printf("Cannot allocate upload buffers\n");
+		free(pipe.buf[0]);
+		free(pipe.buf[1]);
+		return -1;
+	}
 
-	while (1) {
-		int rc;
-		rc = dfu_upload(dif->dev_handle, dif->interface,
-		    xfer_size, transaction++, buf);
+	/* tjt - the STM32 ROM loader wants an address first */
+	if (mp->prof->proto == PROTO_DFUSE) {
+		rc = dfuse_upload_start(mp);
+		if (rc < 0) {
+			free(pipe.buf[0]);
+			free(pipe.buf[1]);
+			return rc;
+		}
+		transaction = rc;
+	}
+
+	pthread_create(&writer, NULL, upload_writer, &pipe);
+
+	// printf("Copying data from DFU device to PC\n");
+	dfu_progress_bar("Upload", 0, 1);
+	status_start(mp, expected_size);
+
+	for (;;) {
+		chunk_size = xfer_size;
+		if (expected_size && expected_size - total_bytes < chunk_size)
+			chunk_size = expected_size - total_bytes;
+		if (chunk_size == 0)
+			break;
+
+		/* wait for the writer to be done with this buffer */
+		pthread_mutex_lock(&pipe.lock);
+		while (pipe.len[which])
+			pthread_cond_wait(&pipe.cond, &pipe.lock);
+		pthread_mutex_unlock(&pipe.lock);
+
+		rc = dfu_upload(mp->devh, mp->interface,
+		    chunk_size, transaction++, pipe.buf[which]);
 		if (rc < 0) {
 			// warnx("Error during upload");
 			printf("Error during upload\n");
+			status_error(mp, "upload failed");
 			ret = rc;
-			goto out_free;
+			break;
 		}
+		if (rc == 0)
+			break;
 
-		dfu_file_write_crc(fd, 0, buf, rc);
-		total_bytes += rc;
-
-		if (total_bytes < 0) {
-			// errx(EX_SOFTWARE, "Received too many bytes (wraparound)");
-			printf("Received too many bytes (wraparound)\n");
-			goto out_free:
-		}
+		pthread_mutex_lock(&pipe.lock);
+		pipe.len[which] = rc;
+		pthread_cond_signal(&pipe.cond);
+		pthread_mutex_unlock(&pipe.lock);
+		which ^= 1;
 
-		if (rc < xfer_size) {
+		total_bytes += rc;
+		if (rc < chunk_size) {
 			/* last block, return */
-			ret = total_bytes;
 			break;
 		}
-		//dfu_progress_bar("Upload", total_bytes, expected_size);
+		dfu_progress_bar("Upload", total_bytes, expected_size);
+		status_bytes(mp, total_bytes);
 	}
-	ret = 0;
 
-out_free:
-	//dfu_progress_bar("Upload", total_bytes, total_bytes);
+	pthread_mutex_lock(&pipe.lock);
+	pipe.done = 1;
+	pthread_cond_signal(&pipe.cond);
+	pthread_mutex_unlock(&pipe.lock);
+	pthread_join(writer, NULL);
+
+	dfu_progress_bar("Upload", total_bytes, total_bytes);
 	if (total_bytes == 0)
 		printf("\nFailed.\n");
-	free(buf);
+	free(pipe.buf[0]);
+	free(pipe.buf[1]);
+	pthread_mutex_destroy(&pipe.lock);
+	pthread_cond_destroy(&pipe.cond);
+
 	if (verbose)
 		printf("Received a total of %i bytes\n", total_bytes);
 	if (expected_size != 0 && total_bytes != expected_size) {
 		// errx(EX_SOFTWARE, "Unexpected number of bytes uploaded from device");
 		printf("Unexpected number of bytes uploaded from device\n");
 	}
-	return ret;
+	if (pipe.error) {
+		printf("IO error writing upload data\n");
+		return -1;
+	}
+	if (ret < 0)
+		return ret;
+	return total_bytes;
 }
-#endif
 
 #define PROGRESS_BAR_WIDTH 25
 
@@ -267,6 +509,10 @@ dfu_progress_bar(const char *desc, unsigned long curr, unsigned long max)
 	unsigned long progress;
 	unsigned long x;
 
+	/* several boards at once would make a mess */
+	if (!show_progress)
+		return;
+
 	/* check for not known maximum */
 	if (max < curr)
 		max = curr + 1;
@@ -0,0 +1,295 @@
+/* dfuse.c - maple-util
+ *
+ * Backend for the ST "DfuSe" protocol spoken by the STM32
+ * system bootloader in ROM (0483:df11), for boards that come
+ * up there rather than in the Maple loader.
+ *
+ * DfuSe is DFU with a few extras, all riding on DNLOAD:
+ * a DNLOAD with wValue = 0 is a command (the first byte says
+ * which one), and data blocks go with wValue = 2, 3, ...,
+ * landing at address pointer + (wValue - 2) * transfer size.
+ * We use two commands:
+ *
+ *   0x21 addr	- Set Address Pointer
+ *   0x41 addr	- Erase the page (or sector) holding addr
+ *
+ * and only erase the pages the image covers, each one once, which
+ * is far quicker than a mass erase on the bigger parts.
+ *
+ * Page sizes differ a lot: 2K on the F105/F107, sectors of 16K to
+ * 128K on the F2/F4.  The ROM loader tells us in the name of the
+ * alt setting, a DfuSe memory string like:
+ *
+ *   @Internal Flash  /0x08000000/04*016Kg,01*064Kg,07*128Kg
+ *
+ * which is 4 sectors of 16K, then one of 64K, then 7 of 128K.
+ * If there isn't one, we go by the page size in the profile.
+ * A zero length DNLOAD makes the ROM loader leave DFU mode and
+ * start the application, so no detach or reset is needed after.
+ *
+ * The usual dfu.c requests do all the talking.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libusb.h>
+
+#include "maple.h"
+#include "dfu.h"
+
+#define DFUSE_SET_ADDRESS	0x21
+#define DFUSE_ERASE_PAGE	0x41
+
+extern int verbose;
+extern int show_progress;
+
+/* Wait out the device after a DNLOAD, checking how it went.
+ */
+static int
+dfuse_wait ( struct maple_device *mp, char *what )
+{
+	struct dfu_status dst;
+
+	for ( ;; ) {
+	    if ( dfu_get_status ( mp, &dst ) < 0 ) {
+		printf ( "Error during %s get_status\n", what );
+		return -1;
+	    }
+	    if ( dst.bStatus != DFU_STATUS_OK ) {
+		printf ( "%s failed, state(%u) = %s, status(%u) = %s\n", what,
+		    dst.bState, dfu_state_to_string ( dst.bState ),
+		    dst.bStatus, dfu_status_to_string ( dst.bStatus ) );
+		return -1;
+	    }
+	    if ( dst.bState == DFU_STATE_dfuDNLOAD_IDLE || dst.bState == DFU_STATE_dfuIDLE )
+		return 0;
+	    milli_sleep ( dst.bwPollTimeout );
+	}
+}
+
+static int
+dfuse_command ( struct maple_device *mp, int cmd, unsigned int addr, char *what )
+{
+	unsigned char buf[5];
+
+	buf[0] = cmd;
+	buf[1] = addr & 0xff;
+	buf[2] = (addr >> 8) & 0xff;
+	buf[3] = (addr >> 16) & 0xff;
+	buf[4] = (addr >> 24) & 0xff;
+
+	if ( dfu_download ( mp->devh, mp->interface, sizeof(buf), 0, buf ) < 0 ) {
+	    printf ( "Error sending %s command\n", what );
+	    return -1;
+	}
+	return dfuse_wait ( mp, what );
+}
+
+/* Read one region of a DfuSe memory string, at p (just past the
+ * '/' before the address).  Returns where the next region starts,
+ * or NULL if that was the last (or it made no sense).
+ */
+static char *
+dfuse_region ( char *p, struct dfuse_layout *lp )
+{
+	char *end;
+	long count, size;
+
+	lp->nrun = 0;
+	lp->base = strtoul ( p, &end, 16 );
+	if ( end == p || *end != '/' )
+	    return NULL;
+	p = end + 1;
+
+	for ( ;; ) {
+	    count = strtol ( p, &end, 10 );
+	    if ( end == p || *end != '*' || count <= 0 )
+		break;
+	    p = end + 1;
+	    size = strtol ( p, &end, 10 );
+	    if ( end == p || size <= 0 )
+		break;
+	    p = end;
+	    if ( *p == 'K' )
+		size *= 1024;
+	    else if ( *p == 'M' )
+		size *= 1024 * 1024;
+	    if ( *p == 'K' || *p == 'M' || *p == 'B' || *p == ' ' )
+		p++;
+	    if ( *p >= 'a' && *p <= 'g' )	/* readable, erasable, writable */
+		p++;
+
+	    if ( lp->nrun == DFUSE_MAX_RUNS )
+		break;
+	    lp->count[lp->nrun] = count;
+	    lp->size[lp->nrun] = size;
+	    lp->nrun++;
+
+	    if ( *p != ',' )
+		break;
+	    p++;
+	}
+
+	if ( *p == '/' )
+	    return p + 1;
+	return NULL;
+}
+
+/* From the alt setting name, the layout of the region
+ * holding addr.  Leaves nrun 0 if there is none.
+ */
+void
+dfuse_layout ( char *name, unsigned int addr, struct dfuse_layout *lp )
+{
+	struct dfuse_layout region;
+	unsigned int end;
+	char *p;
+	int i;
+
+	lp->nrun = 0;
+	if ( name[0] != '@' || ! (p = strchr ( name, '/' )) )
+	    return;
+
+	for ( p++; p; ) {
+	    p = dfuse_region ( p, &region );
+	    end = region.base;
+	    for ( i=0; i<region.nrun; i++ )
+		end += region.count[i] * region.size[i];
+	    if ( region.nrun && addr >= region.base && addr < end ) {
+		*lp = region;
+		return;
+	    }
+	}
+}
+
+/* The page (or sector) holding addr: where it starts and how big.
+ */
+static void
+dfuse_sector ( struct maple_device *mp, unsigned int addr, unsigned int *start, int *size )
+{
+	struct dfuse_layout *lp = &mp->layout;
+	unsigned int a = lp->base;
+	int i, n;
+
+	for ( i=0; i<lp->nrun; i++ ) {
+	    for ( n=0; n<lp->count[i]; n++ ) {
+		if ( addr >= a && addr < a + lp->size[i] ) {
+		    *start = a;
+		    *size = lp->size[i];
+		    return;
+		}
+		a += lp->size[i];
+	    }
+	}
+
+	/* Not in the layout (or there isn't one), go by the profile */
+	*size = mp->prof->page_size;
+	*start = addr - (addr - mp->prof->flash_base) % *size;
+}
+
+/* Bytes of flash from the profile base to the end of the
+ * region the loader told us about, -1 if it didn't.
+ */
+int
+dfuse_flash_size ( struct maple_device *mp )
+{
+	struct dfuse_layout *lp = &mp->layout;
+	unsigned int end = lp->base;
+	int i;
+
+	if ( ! lp->nrun )
+	    return -1;
+	for ( i=0; i<lp->nrun; i++ )
+	    end += lp->count[i] * lp->size[i];
+	return end - mp->prof->flash_base;
+}
+
+int
+dfuse_set_address ( struct maple_device *mp, unsigned int addr )
+{
+	return dfuse_command ( mp, DFUSE_SET_ADDRESS, addr, "set address" );
+}
+
+/* Get ready to read flash back.
+ * Uploads read from the address pointer, once we are idle again,
+ * and the data blocks are numbered from 2 just like downloads.
+ * Returns the first block number, or -1.
+ */
+int
+dfuse_upload_start ( struct maple_device *mp )
+{
+	if ( dfuse_set_address ( mp, mp->prof->flash_base ) < 0 )
+	    return -1;
+	if ( dfu_abort_to_idle ( mp ) < 0 )
+	    return -1;
+	return 2;
+}
+
+int
+dfuse_do_dnload ( struct maple_device *mp, struct dfu_file *fp )
+{
+	struct maple_profile *pp = mp->prof;
+	unsigned int base = pp->flash_base;
+	unsigned int addr;
+	unsigned int start;
+	int size;
+	int nerase = 0;
+	int bytes_sent = 0;
+	int chunk_size;
+	int block = 2;
+
+	if ( show_progress )
+	    printf ( "Downloading %d bytes from %s (DfuSe)\n", fp->size, fp->name );
+	status_start ( mp, fp->size );
+
+	/* Erase just what we are about to write, each sector once */
+	for ( addr = base; addr < base + fp->size; addr = start + size ) {
+	    dfuse_sector ( mp, addr, &start, &size );
+	    if ( verbose > 1 )
+		printf ( "Erase %dK at 0x%08x\n", size / 1024, start );
+	    if ( dfuse_command ( mp, DFUSE_ERASE_PAGE, start, "page erase" ) < 0 )
+		return 0;
+	    nerase++;
+	}
+	if ( verbose )
+	    printf ( "Erased %d pages%s\n", nerase, mp->layout.nrun ? " (layout from the loader)" : "" );
+
+	if ( dfuse_set_address ( mp, base ) < 0 )
+	    return 0;
+
+	while ( bytes_sent < fp->size ) {
+	    chunk_size = fp->size - bytes_sent;
+	    if ( chunk_size > mp->xfer_size )
+		chunk_size = mp->xfer_size;
+
+	    if ( chunk_wait ( fp, bytes_sent + chunk_size ) )
+		return bytes_sent;
+	    if ( dfu_download ( mp->devh, mp->interface, chunk_size, block++,
+		    (unsigned char *) patch_chunk ( mp, fp, bytes_sent, chunk_size ) ) < 0 ) {
+		printf ( "Error during download\n" );
+		return bytes_sent;
+	    }
+	    if ( dfuse_wait ( mp, "download" ) < 0 )
+		return bytes_sent;
+
+	    bytes_sent += chunk_size;
+	    status_bytes ( mp, bytes_sent );
+	}
+
+	/* Point back at the start and leave DFU mode,
+	 * the ROM loader jumps to the application from here.
+	 */
+	if ( dfuse_set_address ( mp, base ) < 0 )
+	    return bytes_sent;
+	if ( dfu_download ( mp->devh, mp->interface, 0, 2, NULL ) < 0 ) {
+	    printf ( "Error sending leave request\n" );
+	    return bytes_sent;
+	}
+	dfuse_wait ( mp, "leave" );
+
+	return bytes_sent;
+}
+
+/* THE END */
@@ -0,0 +1,23 @@
+/* hash.c - maple-util
+ *
+ * 64 bit FNV-1a.  Call with HASH_INIT to start, then keep
+ * feeding the returned value back in to hash a stream.
+ */
+
+#include "hash.h"
+
+#define FNV_PRIME	0x100000001b3ULL
+
+uint64_t
+hash_update ( uint64_t h, const void *buf, int len )
+{
+	const unsigned char *p = buf;
+
+	while ( len-- > 0 ) {
+	    h ^= *p++;
+	    h *= FNV_PRIME;
+	}
+	return h;
+}
+
+/* THE END */
@@ -0,0 +1,19 @@
+/* hash.h - maple-util
+ *
+ * A simple running hash (64 bit FNV-1a) used to fingerprint
+ * images, payloads and flash contents.  Not cryptographic,
+ * but plenty good to tell one firmware image from another.
+ */
+
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdint.h>
+
+#define HASH_INIT	0xcbf29ce484222325ULL
+
+uint64_t hash_update ( uint64_t, const void *, int );
+
+#define hash_buf(buf,len)	hash_update ( HASH_INIT, buf, len )
+
+#endif /* HASH_H */
@@ -0,0 +1,289 @@
+/* hexfile.c - maple-util
+ *
+ * Read Intel HEX and Motorola S-record files, so we can take
+ * firmware the way vendors ship it without an objcopy step.
+ *
+ * One pass through the file: each record has its checksum checked
+ * and its data dropped straight into a buffer that covers the app
+ * region, which starts out erased (0xff).  Records outside the
+ * region are an error, since the loader could not put them there.
+ * What comes out is an image that starts at the region base (the
+ * gaps, and any space before the first record, are left 0xff),
+ * padded with 0xff to a whole number of transfers, just as if we
+ * had read a raw binary.
+ *
+ * The region is the flash (or RAM, with -R) of the Maple loader
+ * profile, since we read the file before we know the board.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <libusb.h>
+
+#include "maple.h"
+
+extern int verbose;
+extern int ram_mode;
+
+#define HEX_LINE	600	/* 255 data bytes is 510 hex digits */
+
+#define FMT_IHEX	1
+#define FMT_SREC	2
+
+struct hex_image {
+	char *name;
+	int line;
+	unsigned int base;
+	unsigned int size;
+	unsigned char *buf;
+	unsigned int top;	/* highest offset written, plus one */
+};
+
+static int
+hex_nibble ( int c )
+{
+	if ( c >= '0' && c <= '9' )
+	    return c - '0';
+	if ( c >= 'A' && c <= 'F' )
+	    return c - 'A' + 10;
+	if ( c >= 'a' && c <= 'f' )
+	    return c - 'a' + 10;
+	return -1;
+}
+
+/* Turn the hex digits after the record start into bytes.
+ * Returns how many bytes, or -1 if something is not hex.
+ */
+static int
+hex_bytes ( char *p, unsigned char *out )
+{
+	int hi, lo;
+	int n = 0;
+
+	while ( *p && *p != '\r' && *p != '\n' ) {
+	    hi = hex_nibble ( p[0] );
+	    lo = hex_nibble ( p[1] );
+	    if ( hi < 0 || lo < 0 )
+		return -1;
+	    out[n++] = (hi << 4) | lo;
+	    p += 2;
+	}
+	return n;
+}
+
+static int
+hex_store ( struct hex_image *hp, unsigned int addr, unsigned char *data, int len )
+{
+	unsigned int off;
+
+	if ( len == 0 )
+	    return 0;
+	/* Careful, addr + len can wrap */
+	if ( addr < hp->base || addr - hp->base > hp->size ||
+		(unsigned int) len > hp->size - (addr - hp->base) ) {
+	    printf ( "%s line %d: data at 0x%08x is outside 0x%08x to 0x%08x\n",
+		hp->name, hp->line, addr, hp->base, hp->base + hp->size );
+	    return 1;
+	}
+	off = addr - hp->base;
+	memcpy ( hp->buf + off, data, len );
+	if ( off + len > hp->top )
+	    hp->top = off + len;
+	return 0;
+}
+
+/* :LLAAAATT<data>CC, the checksum makes all the bytes sum to 0.
+ * Returns 0 to go on, 1 for an error, 2 at the end record.
+ */
+static int
+ihex_record ( struct hex_image *hp, char *line, unsigned int *upper )
+{
+	unsigned char rec[HEX_LINE / 2];
+	unsigned char sum = 0;
+	unsigned int addr;
+	int len;
+	int n;
+	int i;
+
+	n = hex_bytes ( line + 1, rec );
+	if ( n < 5 || n != rec[0] + 5 ) {
+	    printf ( "%s line %d: bad record\n", hp->name, hp->line );
+	    return 1;
+	}
+	for ( i=0; i<n; i++ )
+	    sum += rec[i];
+	if ( sum ) {
+	    printf ( "%s line %d: bad checksum\n", hp->name, hp->line );
+	    return 1;
+	}
+
+	len = rec[0];
+	addr = (rec[1] << 8) | rec[2];
+	switch ( rec[3] ) {
+	    case 0:	/* data */
+		return hex_store ( hp, *upper + addr, rec + 4, len );
+	    case 1:	/* end of file */
+		return 2;
+	    case 2:	/* extended segment address */
+		*upper = ((rec[4] << 8) | rec[5]) << 4;
+		return 0;
+	    case 4:	/* extended linear address */
+		*upper = ((rec[4] << 8) | rec[5]) << 16;
+		return 0;
+	    case 3:	/* start addresses, the vector table says that */
+	    case 5:
+		return 0;
+	}
+	printf ( "%s line %d: unknown record type %d\n", hp->name, hp->line, rec[3] );
+	return 1;
+}
+
+/* Sn LL AAAA.. data CC, LL counts the address, data and checksum,
+ * which is the ones complement of the sum of everything but Sn.
+ */
+static int
+srec_record ( struct hex_image *hp, char *line )
+{
+	unsigned char rec[HEX_LINE / 2];
+	unsigned char sum = 0;
+	unsigned int addr = 0;
+	int type = line[1] - '0';
+	int alen;
+	int n;
+	int i;
+
+	n = hex_bytes ( line + 2, rec );
+	if ( n < 3 || n != rec[0] + 1 ) {
+	    printf ( "%s line %d: bad record\n", hp->name, hp->line );
+	    return 1;
+	}
+	for ( i=0; i<n; i++ )
+	    sum += rec[i];
+	if ( sum != 0xff ) {
+	    printf ( "%s line %d: bad checksum\n", hp->name, hp->line );
+	    return 1;
+	}
+
+	switch ( type ) {
+	    case 0:			/* header */
+	    case 5:			/* record counts */
+	    case 6:
+		return 0;
+	    case 1:
+	    case 2:
+	    case 3:
+		alen = type + 1;
+		break;
+	    case 7:			/* start address, the end */
+	    case 8:
+	    case 9:
+		return 2;
+	    default:
+		printf ( "%s line %d: unknown record type S%c\n", hp->name, hp->line, line[1] );
+		return 1;
+	}
+
+	if ( n < alen + 2 ) {
+	    printf ( "%s line %d: bad record\n", hp->name, hp->line );
+	    return 1;
+	}
+	for ( i=0; i<alen; i++ )
+	    addr = (addr << 8) | rec[1+i];
+	return hex_store ( hp, addr, rec + 1 + alen, n - alen - 2 );
+}
+
+/* What sort of file is this, by the name.  0 for a raw binary.
+ */
+int
+hex_format ( char *name )
+{
+	static char *ihex[] = { ".hex", ".ihx", ".ihex", NULL };
+	static char *srec[] = { ".srec", ".s19", ".s28", ".s37", ".mot", NULL };
+	char *ext;
+	int i;
+
+	ext = strrchr ( name, '.' );
+	if ( ! ext )
+	    return 0;
+	for ( i=0; ihex[i]; i++ )
+	    if ( strcasecmp ( ext, ihex[i] ) == 0 )
+		return FMT_IHEX;
+	for ( i=0; srec[i]; i++ )
+	    if ( strcasecmp ( ext, srec[i] ) == 0 )
+		return FMT_SREC;
+	return 0;
+}
+
+/* Fill in file->buf and file->size from a hex file.
+ * Returns 0 if all went well.
+ */
+int
+hex_read ( struct dfu_file *file )
+{
+	struct maple_profile *pp = profile_default ( MAPLE_LOADER );
+	struct hex_image hi;
+	char line[HEX_LINE];
+	unsigned int upper = 0;
+	unsigned int size;
+	int fmt = hex_format ( file->name );
+	int xfer = pp->xfer_size;
+	int rv = 0;
+	FILE *fp;
+
+	fp = fopen ( file->name, "r" );
+	if ( ! fp )
+	    return 1;
+
+	memset ( &hi, 0, sizeof(hi) );
+	hi.name = file->name;
+	hi.base = ram_mode ? pp->ram_base : pp->flash_base;
+	hi.size = ram_mode ? pp->ram_size : pp->flash_size;
+	hi.buf = malloc ( hi.size );
+	if ( ! hi.buf ) {
+	    fclose ( fp );
+	    return 1;
+	}
+	memset ( hi.buf, 0xff, hi.size );
+
+	while ( rv == 0 && fgets ( line, sizeof(line), fp ) ) {
+	    hi.line++;
+	    if ( line[0] == '\n' || line[0] == '\r' )
+		continue;
+	    if ( fmt == FMT_IHEX && line[0] == ':' )
+		rv = ihex_record ( &hi, line, &upper );
+	    else if ( fmt == FMT_SREC && line[0] == 'S' )
+		rv = srec_record ( &hi, line );
+	    else {
+		printf ( "%s line %d: not a %s record\n", hi.name, hi.line,
+		    fmt == FMT_IHEX ? "HEX" : "S-record" );
+		rv = 1;
+	    }
+	}
+	fclose ( fp );
+
+	if ( rv == 0 )
+	    printf ( "%s: no end record, the file must be cut short\n", file->name );
+	else if ( rv == 2 && hi.top == 0 )
+	    printf ( "%s: no data\n", file->name );
+	if ( rv != 2 || hi.top == 0 ) {
+	    free ( hi.buf );
+	    return 1;
+	}
+
+	/* A whole number of transfers, the loader writes them all anyway */
+	size = (hi.top + xfer - 1) / xfer * xfer;
+	if ( size > hi.size )
+	    size = hi.size;
+
+	file->buf = realloc ( hi.buf, size );
+	file->size = size;
+	if ( verbose )
+	    printf ( "%s: %d bytes of image at 0x%08x, %d with padding\n",
+		file->name, hi.top, hi.base, size );
+	return 0;
+}
+
+/* THE END */
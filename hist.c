@@ -0,0 +1,233 @@
+/* hist.c - maple-util
+ *
+ * Latency histograms for control transfers.
+ *
+ * These are HDR style log-linear histograms: values below 16 us
+ * get a bucket each, above that every power of two is split
+ * into 16 buckets.  So any value is known to within about 6 percent,
+ * from 1 us up past an hour, in a fixed 544 counters.
+ *
+ * We keep one set per device, and in each set one histogram
+ * per request type, plus one for the time we spend sleeping
+ * because the device told us to (bwPollTimeout).  Comparing
+ * "DNLOAD" and "GETSTATUS" against "poll wait" tells you
+ * whether a slow flash is the USB or the flash programming.
+ * "handoff" is how long the loader took to let go of the board,
+ * from the zero length DNLOAD to the end of the reset.
+ *
+ * A dump can be had at any time with SIGUSR1, and at exit with -H.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include <libusb.h>
+
+#include "maple.h"
+#include "dfu.h"
+#include "hist.h"
+
+#define SUB_BITS	4
+#define SUB_COUNT	(1 << SUB_BITS)
+#define NBUCKET		(34 * SUB_COUNT)
+
+#define MAX_HIST_DEV	64	/* as many as status slots, the rest share one */
+#define DEV_NAME_LEN	24
+
+struct hist {
+	unsigned int count;
+	unsigned int timeouts;
+	unsigned int errors;
+	unsigned long long max;
+	unsigned int bucket[NBUCKET];
+};
+
+struct hist_dev {
+	char name[DEV_NAME_LEN];
+	struct hist req[HIST_NREQ];
+};
+
+int hist_active = 0;
+
+/* One more at the end for any past MAX_HIST_DEV */
+static struct hist_dev hist_devs[MAX_HIST_DEV + 1];
+static int hist_ndev;
+static int hist_overflow;
+static pthread_mutex_t hist_lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile sig_atomic_t hist_dump_pending;
+
+static const char *hist_req_name ( int req )
+{
+	if ( req == HIST_POLL_WAIT )
+	    return "poll wait";
+	if ( req == HIST_HANDOFF )
+	    return "handoff";
+	return dfu_request_to_string ( req );
+}
+
+static int
+value_to_bucket ( unsigned long long v )
+{
+	int msb;
+	int shift;
+	int idx;
+
+	if ( v < SUB_COUNT )
+	    return v;
+
+	msb = 63 - __builtin_clzll ( v );
+	shift = msb - SUB_BITS;
+	idx = (shift + 1) * SUB_COUNT + (int) ((v >> shift) - SUB_COUNT);
+	if ( idx >= NBUCKET )
+	    idx = NBUCKET - 1;
+	return idx;
+}
+
+/* Report the top of the bucket, so percentiles err high.
+ */
+static unsigned long long
+bucket_to_value ( int idx )
+{
+	int shift;
+	unsigned long long sub;
+
+	if ( idx < SUB_COUNT )
+	    return idx;
+
+	shift = idx / SUB_COUNT - 1;
+	sub = idx % SUB_COUNT + SUB_COUNT;
+	return ((sub + 1) << shift) - 1;
+}
+
+static unsigned long long
+hist_percentile ( struct hist *hp, int pct )
+{
+	unsigned long long want;
+	unsigned long long seen = 0;
+	int i;
+
+	if ( ! hp->count )
+	    return 0;
+
+	want = ((unsigned long long) hp->count * pct + 99) / 100;
+	for ( i=0; i<NBUCKET; i++ ) {
+	    seen += hp->bucket[i];
+	    if ( seen >= want )
+		break;
+	}
+	if ( bucket_to_value ( i ) > hp->max )
+	    return hp->max;
+	return bucket_to_value ( i );
+}
+
+/* Devices are known by bus and port path, like "1-1.2",
+ * which is what sysfs calls them too.  A NULL handle
+ * is a simulated device.
+ */
+static void
+hist_device_name ( libusb_device_handle *devh, char *name )
+{
+	if ( ! devh ) {
+	    strcpy ( name, "simulated" );
+	    return;
+	}
+
+	maple_port_path ( libusb_get_device ( devh ), name );
+}
+
+static struct hist_dev *
+hist_find_dev ( libusb_device_handle *devh )
+{
+	char name[DEV_NAME_LEN];
+	int i;
+
+	hist_device_name ( devh, name );
+
+	for ( i=0; i<hist_ndev; i++ )
+	    if ( strcmp ( hist_devs[i].name, name ) == 0 )
+		return &hist_devs[i];
+
+	/* Table full, the rest go in together, and the dump says so */
+	if ( hist_ndev == MAX_HIST_DEV ) {
+	    hist_overflow = 1;
+	    return &hist_devs[MAX_HIST_DEV];
+	}
+
+	strcpy ( hist_devs[hist_ndev].name, name );
+	return &hist_devs[hist_ndev++];
+}
+
+/* Time is given in ns, we keep us */
+void
+hist_record ( libusb_device_handle *devh, int req, unsigned long long ns, int result )
+{
+	struct hist *hp;
+	unsigned long long us = ns / 1000;
+
+	if ( req < 0 || req >= HIST_NREQ )
+	    return;
+
+	pthread_mutex_lock ( &hist_lock );
+	hp = &hist_find_dev ( devh )->req[req];
+	hp->count++;
+	hp->bucket[value_to_bucket ( us )]++;
+	if ( us > hp->max )
+	    hp->max = us;
+	if ( result == LIBUSB_ERROR_TIMEOUT )
+	    hp->timeouts++;
+	else if ( result < 0 )
+	    hp->errors++;
+	pthread_mutex_unlock ( &hist_lock );
+
+	/* Signal handlers can't safely print, so
+	 * the dump happens here on the next transfer.
+	 */
+	if ( hist_dump_pending ) {
+	    hist_dump_pending = 0;
+	    hist_dump ( stderr );
+	}
+}
+
+void
+hist_dump ( FILE *fp )
+{
+	struct hist *hp;
+	int i, j;
+
+	pthread_mutex_lock ( &hist_lock );
+	for ( i=0; i<hist_ndev + hist_overflow; i++ ) {
+	    if ( i == MAX_HIST_DEV )
+		fprintf ( fp, "Latency (us) for all devices past the first %d, lumped together\n", MAX_HIST_DEV );
+	    else
+		fprintf ( fp, "Latency (us) for device %s\n", hist_devs[i].name );
+	    fprintf ( fp, "  %-10s %8s %8s %8s %8s %8s %8s\n",
+		"request", "count", "p50", "p99", "max", "timeouts", "errors" );
+	    for ( j=0; j<HIST_NREQ; j++ ) {
+		hp = &hist_devs[i].req[j];
+		if ( ! hp->count )
+		    continue;
+		fprintf ( fp, "  %-10s %8u %8llu %8llu %8llu %8u %8u\n",
+		    hist_req_name ( j ), hp->count,
+		    hist_percentile ( hp, 50 ), hist_percentile ( hp, 99 ),
+		    hp->max, hp->timeouts, hp->errors );
+	    }
+	}
+	pthread_mutex_unlock ( &hist_lock );
+}
+
+static void
+hist_signal ( int sig )
+{
+	hist_dump_pending = 1;
+}
+
+void
+hist_init ( void )
+{
+	hist_active = 1;
+	signal ( SIGUSR1, hist_signal );
+}
+
+/* THE END */
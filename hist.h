@@ -0,0 +1,26 @@
+/* hist.h - maple-util
+ *
+ * Latency histograms, per DFU request type and per device.
+ */
+
+#ifndef HIST_H
+#define HIST_H
+
+#include <stdio.h>
+#include <libusb.h>
+
+/* The DFU requests are 0 through 6, we add pseudo requests
+ * for time spent honoring bwPollTimeout, and for the handoff
+ * (the end of a download until the loader lets go).
+ */
+#define HIST_POLL_WAIT	7
+#define HIST_HANDOFF	8
+#define HIST_NREQ	9
+
+extern int hist_active;
+
+void hist_init ( void );
+void hist_record ( libusb_device_handle *, int, unsigned long long, int );
+void hist_dump ( FILE * );
+
+#endif /* HIST_H */
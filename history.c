@@ -0,0 +1,538 @@
+/* history.c - maple-util
+ *
+ * Flash history.  With -j file every flash adds one fixed size
+ * record to file, and one small entry to file.idx, so that over
+ * months we can see a board (or a port on the hub) going bad:
+ * downloads getting slower, more polls, longer waits for the loader.
+ * Both files are only ever appended to.
+ *
+ * The index entry is just the hash of the board name and the
+ * record number, so asking about one board loads the index,
+ * sorts it by hash and looks the name up, then reads only that
+ * board's records.  If we died between the two writes, the index
+ * is caught up from the records the next time we add to it;
+ * a query just reads any records past the end of the index.
+ *
+ * -J all gives a summary for every board and every port,
+ * -J name gives the records and trend for one board or port.
+ * Boards are known by USB serial number if they have a useful
+ * one, else by port path.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <libusb.h>
+
+#include "maple.h"
+#include "dfu.h"
+#include "hash.h"
+
+#define HISTORY_MAGIC	0x4d504c48	/* "MPLH" */
+
+#define HISTORY_OK	0
+#define HISTORY_FAIL	1	/* download failed */
+#define HISTORY_NOBOOT	2	/* flashed, app did not come up */
+
+/* 88 bytes, times are in microseconds */
+struct history_rec {
+	uint32_t magic;
+	uint32_t when;			/* unix time */
+	char serial[24];
+	char port[16];
+	uint64_t image_hash;
+	uint32_t bytes;
+	uint32_t t_loader;		/* getting into the loader */
+	uint32_t t_download;
+	uint32_t t_boot;		/* reset to app, 0 if not checked */
+	uint32_t polls;
+	uint32_t retries;
+	uint8_t dfu_status;		/* last bStatus we saw */
+	uint8_t result;
+	uint8_t pad[6];
+};
+
+struct history_idx {
+	uint64_t key;			/* hash of serial and of port */
+	uint64_t port;
+	uint32_t recno;
+	uint32_t pad;
+};
+
+/* These are the on-disk formats */
+_Static_assert ( sizeof(struct history_rec) == 88, "history record is not 88 bytes" );
+_Static_assert ( sizeof(struct history_idx) == 24, "history index is not 24 bytes" );
+
+static char *history_path;
+static int history_fd = -1;
+static int index_fd = -1;
+
+/* Bundle mode adds records from many threads */
+static pthread_mutex_t history_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char *
+history_name ( struct history_rec *rp )
+{
+	return rp->serial[0] ? rp->serial : rp->port;
+}
+
+static void
+history_key ( struct history_rec *rp, int recno, struct history_idx *ip )
+{
+	char *name = history_name ( rp );
+
+	memset ( ip, 0, sizeof(*ip) );
+	ip->key = hash_buf ( name, strlen(name) );
+	ip->port = hash_buf ( rp->port, strlen(rp->port) );
+	ip->recno = recno;
+}
+
+/* Add index entries for any records past the end of the index.
+ */
+static void
+history_catch_up ( void )
+{
+	struct history_rec rec;
+	struct history_idx idx;
+	off_t nrec, nidx;
+
+	nrec = lseek ( history_fd, 0, SEEK_END ) / sizeof(rec);
+	nidx = lseek ( index_fd, 0, SEEK_END ) / sizeof(idx);
+
+	for ( ; nidx < nrec; nidx++ ) {
+	    if ( pread ( history_fd, &rec, sizeof(rec), nidx * sizeof(rec) ) != sizeof(rec) )
+		break;
+	    history_key ( &rec, nidx, &idx );
+	    if ( write ( index_fd, &idx, sizeof(idx) ) != sizeof(idx) )
+		break;
+	}
+}
+
+static int
+history_files ( char *path, int flags )
+{
+	char ipath[256];
+
+	snprintf ( ipath, sizeof(ipath), "%s.idx", path );
+	history_fd = open ( path, flags, 0644 );
+	index_fd = open ( ipath, flags, 0644 );
+	if ( history_fd < 0 || index_fd < 0 ) {
+	    printf ( "Cannot open history files %s and %s\n", path, ipath );
+	    return 1;
+	}
+	return 0;
+}
+
+int
+history_open ( char *path )
+{
+	history_path = path;
+	if ( history_files ( path, O_RDWR | O_CREAT | O_APPEND ) )
+	    return 1;
+	history_catch_up ();
+	return 0;
+}
+
+/* Add a record for a flash.  serial may be NULL, times in ns.
+ */
+void
+history_add ( struct maple_device *mp, char *serial, char *port, struct dfu_file *fp,
+	int bytes, unsigned long long t_loader, unsigned long long t_download,
+	unsigned long long t_boot, int result )
+{
+	struct history_rec rec;
+	struct history_idx idx;
+	off_t recno;
+
+	if ( history_fd < 0 )
+	    return;
+
+	/* A compressed image has its digest once it is all unpacked */
+	file_wait ( fp );
+
+	memset ( &rec, 0, sizeof(rec) );
+	rec.magic = HISTORY_MAGIC;
+	rec.when = time ( NULL );
+	if ( serial )
+	    snprintf ( rec.serial, sizeof(rec.serial), "%s", serial );
+	snprintf ( rec.port, sizeof(rec.port), "%s", port );
+	rec.image_hash = fp->digest;
+	rec.bytes = bytes;
+	rec.t_loader = t_loader / 1000;
+	rec.t_download = t_download / 1000;
+	rec.t_boot = t_boot / 1000;
+	rec.polls = mp->polls;
+	rec.retries = mp->retries;
+	rec.dfu_status = mp->last_status;
+	rec.result = result;
+
+	pthread_mutex_lock ( &history_lock );
+	recno = lseek ( history_fd, 0, SEEK_END ) / sizeof(rec);
+	if ( write ( history_fd, &rec, sizeof(rec) ) != sizeof(rec) )
+	    printf ( "Cannot write to history file %s\n", history_path );
+	else {
+	    history_key ( &rec, recno, &idx );
+	    if ( write ( index_fd, &idx, sizeof(idx) ) != sizeof(idx) )
+		printf ( "Cannot write to history index\n" );
+	}
+	pthread_mutex_unlock ( &history_lock );
+}
+
+/* ---------------- */
+/* Queries */
+
+/* Samples of one quantity, for percentiles */
+struct samples {
+	uint32_t *v;
+	int n;
+	int max;
+};
+
+struct group {
+	char name[24];
+	int ops;
+	int fails;
+	struct samples download;
+	struct samples loader;
+	struct samples boot;
+	struct samples polls;
+};
+
+#define MAX_GROUPS	256
+
+static void
+sample_add ( struct samples *sp, uint32_t val )
+{
+	if ( sp->n == sp->max ) {
+	    sp->max = sp->max ? sp->max * 2 : 64;
+	    sp->v = realloc ( sp->v, sp->max * sizeof(uint32_t) );
+	}
+	sp->v[sp->n++] = val;
+}
+
+static int
+cmp_u32 ( const void *a, const void *b )
+{
+	uint32_t x = *(uint32_t *) a;
+	uint32_t y = *(uint32_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Percentile pct of n values starting at v, which gets sorted */
+static uint32_t
+percentile ( uint32_t *v, int n, int pct )
+{
+	if ( n == 0 )
+	    return 0;
+	qsort ( v, n, sizeof(uint32_t), cmp_u32 );
+	return v[(n - 1) * pct / 100];
+}
+
+/* Change in the median from the oldest quarter to the newest,
+ * as a percent.  Must be called before anything sorts the samples.
+ */
+static int
+trend ( struct samples *sp )
+{
+	uint32_t old, new;
+	uint32_t *copy;
+	int q = sp->n / 4;
+
+	if ( q < 2 )
+	    return 0;
+	copy = malloc ( sp->n * sizeof(uint32_t) );
+	memcpy ( copy, sp->v, sp->n * sizeof(uint32_t) );
+	old = percentile ( copy, q, 50 );
+	new = percentile ( copy + sp->n - q, q, 50 );
+	free ( copy );
+	if ( old == 0 )
+	    return 0;
+	return ((int) new - (int) old) * 100 / (int) old;
+}
+
+static void
+group_add ( struct group *gp, struct history_rec *rp )
+{
+	gp->ops++;
+	if ( rp->result != HISTORY_OK )
+	    gp->fails++;
+	if ( rp->result == HISTORY_FAIL )
+	    return;
+	sample_add ( &gp->download, rp->t_download );
+	sample_add ( &gp->loader, rp->t_loader );
+	sample_add ( &gp->polls, rp->polls );
+	if ( rp->t_boot )
+	    sample_add ( &gp->boot, rp->t_boot );
+}
+
+static void
+group_show ( struct group *gp )
+{
+	int t = trend ( &gp->download );
+	int tl = trend ( &gp->loader );
+
+	printf ( "%-24s %5d %5d %8.1f %8.1f %8.1f %+5d%% %8.1f %+5d%% %8.1f %6u\n",
+	    gp->name, gp->ops, gp->fails,
+	    percentile ( gp->download.v, gp->download.n, 50 ) / 1000.0,
+	    percentile ( gp->download.v, gp->download.n, 90 ) / 1000.0,
+	    percentile ( gp->download.v, gp->download.n, 99 ) / 1000.0, t,
+	    percentile ( gp->loader.v, gp->loader.n, 50 ) / 1000.0, tl,
+	    percentile ( gp->boot.v, gp->boot.n, 50 ) / 1000.0,
+	    percentile ( gp->polls.v, gp->polls.n, 90 ) );
+	free ( gp->download.v );
+	free ( gp->loader.v );
+	free ( gp->boot.v );
+	free ( gp->polls.v );
+}
+
+static void
+group_header ( char *what )
+{
+	printf ( "%-24s %5s %5s %8s %8s %8s %6s %8s %6s %8s %6s\n",
+	    what, "ops", "fail", "dl p50", "dl p90", "dl p99", "trend",
+	    "ldr p50", "trend", "boot p50", "polls" );
+}
+
+static struct group *
+group_find ( struct group *tab, int *ng, char *name )
+{
+	int i;
+
+	for ( i=0; i<*ng; i++ )
+	    if ( strcmp ( tab[i].name, name ) == 0 )
+		return &tab[i];
+	if ( *ng == MAX_GROUPS )
+	    return NULL;
+	memset ( &tab[i], 0, sizeof(tab[i]) );
+	snprintf ( tab[i].name, sizeof(tab[i].name), "%s", name );
+	(*ng)++;
+	return &tab[i];
+}
+
+/* Everything, grouped by board and by port.
+ * This reads all the records, in big gulps.
+ */
+static int
+history_all ( void )
+{
+	static struct group boards[MAX_GROUPS];
+	static struct group ports[MAX_GROUPS];
+	struct history_rec rec[256];
+	struct group *gp;
+	int nb = 0;
+	int np = 0;
+	int total = 0;
+	int n;
+	int i;
+
+	lseek ( history_fd, 0, SEEK_SET );
+	while ( (n = read ( history_fd, rec, sizeof(rec) )) > 0 ) {
+	    for ( i=0; i < n / (int) sizeof(rec[0]); i++ ) {
+		if ( rec[i].magic != HISTORY_MAGIC )
+		    continue;
+		total++;
+		gp = group_find ( boards, &nb, history_name ( &rec[i] ) );
+		if ( gp )
+		    group_add ( gp, &rec[i] );
+		gp = group_find ( ports, &np, rec[i].port );
+		if ( gp )
+		    group_add ( gp, &rec[i] );
+	    }
+	}
+
+	printf ( "%d records, times in ms\n\n", total );
+	group_header ( "board" );
+	for ( i=0; i<nb; i++ )
+	    group_show ( &boards[i] );
+	printf ( "\n" );
+	group_header ( "port" );
+	for ( i=0; i<np; i++ )
+	    group_show ( &ports[i] );
+	return 0;
+}
+
+/* The whole index, sorted by board and by port hash.
+ * recno breaks ties so each board's records come out in order.
+ */
+static struct history_idx *by_key;
+static struct history_idx *by_port;
+static int nindex;
+
+static int
+cmp_key ( const void *a, const void *b )
+{
+	const struct history_idx *x = a;
+	const struct history_idx *y = b;
+
+	if ( x->key != y->key )
+	    return x->key < y->key ? -1 : 1;
+	return x->recno < y->recno ? -1 : x->recno > y->recno;
+}
+
+static int
+cmp_port ( const void *a, const void *b )
+{
+	const struct history_idx *x = a;
+	const struct history_idx *y = b;
+
+	if ( x->port != y->port )
+	    return x->port < y->port ? -1 : 1;
+	return x->recno < y->recno ? -1 : x->recno > y->recno;
+}
+
+static int
+index_load ( void )
+{
+	off_t size;
+
+	size = lseek ( index_fd, 0, SEEK_END );
+	nindex = size / sizeof(struct history_idx);
+	by_key = malloc ( nindex * sizeof(struct history_idx) + 1 );
+	by_port = malloc ( nindex * sizeof(struct history_idx) + 1 );
+	if ( ! by_key || ! by_port ) {
+	    printf ( "Cannot allocate history index\n" );
+	    return 1;
+	}
+	if ( pread ( index_fd, by_key, nindex * sizeof(struct history_idx), 0 ) !=
+		(ssize_t) (nindex * sizeof(struct history_idx)) ) {
+	    printf ( "Cannot read history index\n" );
+	    return 1;
+	}
+	memcpy ( by_port, by_key, nindex * sizeof(struct history_idx) );
+	qsort ( by_key, nindex, sizeof(struct history_idx), cmp_key );
+	qsort ( by_port, nindex, sizeof(struct history_idx), cmp_port );
+	return 0;
+}
+
+/* First entry with hash >= want, in by_port if port, else by_key.
+ */
+static int
+index_find ( int port, uint64_t want )
+{
+	int lo = 0;
+	int hi = nindex;
+	int mid;
+
+	while ( lo < hi ) {
+	    mid = (lo + hi) / 2;
+	    if ( (port ? by_port[mid].port : by_key[mid].key) < want )
+		lo = mid + 1;
+	    else
+		hi = mid;
+	}
+	return lo;
+}
+
+static void
+history_show ( struct group *gp, struct history_rec *rp )
+{
+	char when[32];
+	time_t t;
+
+	t = rp->when;
+	strftime ( when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime ( &t ) );
+	printf ( "%-19s %016llx %-16s %7u %9.1f %8.1f %8.1f %5u %s",
+	    when, (unsigned long long) rp->image_hash, rp->port, rp->bytes,
+	    rp->t_download / 1000.0, rp->t_loader / 1000.0, rp->t_boot / 1000.0,
+	    rp->polls,
+	    rp->result == HISTORY_OK ? "ok" : rp->result == HISTORY_FAIL ? "FAILED" : "NO BOOT" );
+	if ( rp->dfu_status )
+	    printf ( " (%s)", dfu_status_to_string ( rp->dfu_status ) );
+	printf ( "\n" );
+	group_add ( gp, rp );
+}
+
+static int
+history_match ( struct history_rec *rp, char *name )
+{
+	return rp->magic == HISTORY_MAGIC &&
+	    (strcmp ( history_name ( rp ), name ) == 0 || strcmp ( rp->port, name ) == 0);
+}
+
+/* One board or port, found through the index.
+ * A name can match as a board and as a port, so we walk both
+ * sorted runs together in record order and skip duplicates.
+ */
+static int
+history_one ( char *name )
+{
+	struct history_rec rec;
+	struct group g;
+	uint64_t key = hash_buf ( name, strlen(name) );
+	uint32_t recno;
+	uint32_t last = ~0;
+	off_t nrec;
+	int k, p;
+
+	memset ( &g, 0, sizeof(g) );
+	snprintf ( g.name, sizeof(g.name), "%s", name );
+
+	if ( index_load () )
+	    return 1;
+
+	printf ( "%-19s %-16s %-16s %7s %9s %8s %8s %5s %s\n",
+	    "when", "image", "port", "bytes", "download", "loader", "boot", "polls", "result" );
+
+	k = index_find ( 0, key );
+	p = index_find ( 1, key );
+	for ( ;; ) {
+	    if ( k < nindex && by_key[k].key != key )
+		k = nindex;
+	    if ( p < nindex && by_port[p].port != key )
+		p = nindex;
+	    if ( k == nindex && p == nindex )
+		break;
+	    if ( p == nindex || (k < nindex && by_key[k].recno <= by_port[p].recno) )
+		recno = by_key[k++].recno;
+	    else
+		recno = by_port[p++].recno;
+	    if ( recno == last )
+		continue;
+	    last = recno;
+	    if ( pread ( history_fd, &rec, sizeof(rec), (off_t) recno * sizeof(rec) ) != sizeof(rec) )
+		continue;
+	    if ( ! history_match ( &rec, name ) )
+		continue;
+	    history_show ( &g, &rec );
+	}
+
+	/* Records the index has not caught up with yet */
+	nrec = lseek ( history_fd, 0, SEEK_END ) / sizeof(rec);
+	for ( recno = nindex; recno < nrec; recno++ ) {
+	    if ( pread ( history_fd, &rec, sizeof(rec), (off_t) recno * sizeof(rec) ) != sizeof(rec) )
+		break;
+	    if ( history_match ( &rec, name ) )
+		history_show ( &g, &rec );
+	}
+
+	free ( by_key );
+	free ( by_port );
+
+	if ( g.ops == 0 ) {
+	    printf ( "Nothing in the history for %s\n", name );
+	    return 1;
+	}
+	printf ( "\n" );
+	group_header ( "" );
+	group_show ( &g );
+	return 0;
+}
+
+int
+history_query ( char *path, char *name )
+{
+	if ( history_files ( path, O_RDONLY ) )
+	    return 1;
+	if ( strcmp ( name, "all" ) == 0 )
+	    return history_all ();
+	return history_one ( name );
+}
+
+/* THE END */
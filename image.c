@@ -0,0 +1,112 @@
+/* image.c - maple-util
+ *
+ * Look over an image before we spend any USB time on it.
+ * A raw binary has nothing in it to say where it was linked,
+ * but a Cortex-M image starts with its vector table, and that
+ * tells us plenty:
+ *
+ *  word 0 - the initial stack pointer, must be in SRAM
+ *  word 1 - the reset vector, must be in the image, Thumb bit set
+ *  2..15  - the exception vectors, must be in the app region
+ *	     with the Thumb bit set (or 0 for unused)
+ *
+ * An image linked at 0x08000000 (for boards without the Maple
+ * loader) is the usual mistake, and gets its own message.
+ * We also check the size against the flash (or RAM) on the board.
+ *
+ * Only looks at the first 64 bytes, so this costs nothing.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <libusb.h>
+
+#include "maple.h"
+
+/* The system exception vectors, after SP and reset */
+#define NUM_VECTORS	16
+
+extern int ram_mode;
+
+static uint32_t
+get_word ( struct dfu_file *fp, int i )
+{
+	unsigned char *p = (unsigned char *) fp->buf + i * 4;
+
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+/* Returns 0 if the image looks good for a board with profile pp.
+ */
+int
+image_check ( struct dfu_file *fp, struct maple_profile *pp )
+{
+	uint32_t base, size;
+	uint32_t sp, vec;
+	int bad = 0;
+	int nvec = 0;
+	int i;
+
+	if ( ram_mode ) {
+	    base = pp->ram_base;
+	    size = pp->ram_size;
+	} else {
+	    base = pp->flash_base;
+	    size = pp->flash_size;
+	}
+
+	if ( fp->size < NUM_VECTORS * 4 ) {
+	    printf ( "%s: only %d bytes, too short to hold a vector table\n", fp->name, fp->size );
+	    return 1;
+	}
+	if ( fp->size > size ) {
+	    printf ( "%s: %d bytes, but %s only has room for %d\n",
+		fp->name, fp->size, pp->name, size );
+	    bad = 1;
+	}
+
+	sp = get_word ( fp, 0 );
+	if ( sp < pp->sram_base || sp > pp->sram_base + pp->sram_size || (sp & 3) ) {
+	    printf ( "%s: initial stack pointer 0x%08x is not in SRAM (0x%08x, %d bytes)\n",
+		fp->name, sp, pp->sram_base, pp->sram_size );
+	    bad = 1;
+	}
+
+	vec = get_word ( fp, 1 );
+	if ( ! (vec & 1) ) {
+	    printf ( "%s: reset vector 0x%08x lacks the Thumb bit\n", fp->name, vec );
+	    bad = 1;
+	} else if ( (vec & ~1) < base || (vec & ~1) >= base + fp->size ) {
+	    printf ( "%s: reset vector 0x%08x is not in the image (0x%08x to 0x%08x)\n",
+		fp->name, vec, base, base + fp->size );
+	    if ( (vec & ~1) < base && (vec & ~1) >= (base & 0xfff00000) )
+		printf ( "%s: linked at 0x%08x ?  %s wants images linked at 0x%08x\n",
+		    fp->name, vec & 0xfff00000, pp->name, base );
+	    bad = 1;
+	}
+
+	/* 7 through 10 and 13 are reserved, the rest may be 0 if unused.
+	 * One bad vector usually means they all are, so just tell of the first.
+	 */
+	for ( i=2; i<NUM_VECTORS; i++ ) {
+	    if ( (i >= 7 && i <= 10) || i == 13 )
+		continue;
+	    vec = get_word ( fp, i );
+	    if ( vec == 0 )
+		continue;
+	    if ( ! (vec & 1) || (vec & ~1) < base || (vec & ~1) >= base + size ) {
+		if ( ! nvec++ )
+		    printf ( "%s: vector %d is 0x%08x, not a Thumb address in 0x%08x to 0x%08x\n",
+			fp->name, i, vec, base, base + size );
+	    }
+	}
+	if ( nvec > 1 )
+	    printf ( "%s: and %d more vectors like that\n", fp->name, nvec - 1 );
+	if ( nvec )
+	    bad = 1;
+
+	return bad;
+}
+
+/* THE END */
@@ -26,15 +26,23 @@
 #include <libusb.h>
 
 #include "maple.h"
+#include "dfu.h"
+#include "trace.h"
+#include "hist.h"
+#include "hash.h"
 // #include "usb_dfu.h"
 
-#define MAPLE_VENDOR		0x1eaf
-#define MAPLE_PROD_LOADER	3
-#define MAPLE_PROD_SERIAL	4
-
-#define MAPLE_XFER_SIZE		1024
+/* How far we look through /dev/ttyACM* for more than one board */
+#define MAX_TTYACM		64
 
 static char *blink_file = "blink.bin";
+
+int verbose = 0;
+int show_progress = 1;
+
+/* Open device handles and device lists, so a soak run can spot leaks */
+int maple_handles = 0;
+int maple_lists = 0;
 // static char *blink_file = "bogus.bin";
 
 /* To allow this script to get access to the Maple DFU loader
@@ -78,24 +86,12 @@ struct maple_device {
 #endif
 
 int list_maple ( libusb_context *, int );
-int find_maple ( libusb_context *, struct maple_device * );
 char *find_maple_serial ( void );
-int get_file ( struct dfu_file * );
-void perform_reset ( struct maple_device * );
-int serial_trigger ( char * );
-int wait_for_loader ( libusb_context * );
+int serial_trigger ( char *, struct maple_profile * );
+int wait_for_loader ( libusb_context *, struct maple_profile * );
 void milli_sleep ( int );
+static int read_file ( struct dfu_file * );
 
-int dfuload_do_dnload ( struct maple_device *, struct dfu_file * );
-int dfu_detach( libusb_device_handle *, const unsigned short, const unsigned short );
-
-/* return codes from find_maple()
- * could be an enum, but I'm too lazy
- */
-#define MAPLE_NONE	0
-#define MAPLE_SERIAL	1
-#define MAPLE_LOADER	2
-#define MAPLE_UNKNOWN	3
 
 void
 error ( char *msg )
@@ -104,18 +100,164 @@ error ( char *msg )
 	exit ( 1 );
 }
 
+int ram_mode = 0;
+
+/* Get the name the loader gives an alt setting, something
+ * like "DFU Program RAM 0x20000C00" on the Maple.
+ * Returns 0 if it had one.
+ */
+static int
+maple_alt_name ( struct maple_device *mp, int alt, char *name, int len )
+{
+	struct libusb_config_descriptor *cp;
+	const struct libusb_interface *ip;
+	int index = 0;
+	int s;
+
+	name[0] = '\0';
+	if ( libusb_get_config_descriptor ( mp->dev, 0, &cp ) || ! cp )
+	    return 1;
+	ip = &cp->interface[mp->interface];
+	if ( mp->interface < cp->bNumInterfaces && alt < ip->num_altsetting )
+	    index = ip->altsetting[alt].iInterface;
+	libusb_free_config_descriptor ( cp );
+
+	if ( ! index )
+	    return 1;
+	s = libusb_get_string_descriptor_ascii ( mp->devh, index, (unsigned char *) name, len );
+	return s <= 0;
+}
+
+/* Look through the extra bytes of an alt setting for the
+ * DFU functional descriptor, return its bmAttributes or -1.
+ */
+static int
+alt_dfu_attr ( const struct libusb_interface_descriptor *idp )
+{
+	const unsigned char *p = idp->extra;
+	int len = idp->extra_length;
+
+	while ( len >= 3 && p[0] >= 2 && p[0] <= len ) {
+	    if ( p[1] == USB_DT_DFU )
+		return p[2];
+	    len -= p[0];
+	    p += p[0];
+	}
+	return -1;
+}
+
+/* bmAttributes from the DFU functional descriptor, which tells us
+ * how the loader finishes up (see perform_reset()).  The Maple has
+ * one, on alt 1 only (see the pickle() notes), so we look at the
+ * alt we use first, then the others.  -1 if we find none.
+ */
+static int
+maple_dfu_attr ( struct maple_device *mp )
+{
+	struct libusb_config_descriptor *cp;
+	const struct libusb_interface *ip;
+	int attr = -1;
+	int i;
+
+	if ( libusb_get_config_descriptor ( mp->dev, 0, &cp ) || ! cp )
+	    return -1;
+
+	if ( mp->interface < cp->bNumInterfaces ) {
+	    ip = &cp->interface[mp->interface];
+	    if ( mp->alt < ip->num_altsetting )
+		attr = alt_dfu_attr ( &ip->altsetting[mp->alt] );
+	    for ( i=0; i<ip->num_altsetting && attr < 0; i++ )
+		attr = alt_dfu_attr ( &ip->altsetting[i] );
+	}
+
+	libusb_free_config_descriptor ( cp );
+	return attr;
+}
+
+/* RAM loads are experimental (see the pickle() notes), so
+ * we check what we can before trusting the loader with one.
+ */
+static int
+maple_ram_check ( struct maple_device *mp )
+{
+	char name[64];
+
+	if ( maple_alt_name ( mp, mp->alt, name, sizeof(name) ) ) {
+	    printf ( "Loader gives no name for alt %d, trying it anyway\n", mp->alt );
+	    return 0;
+	}
+	printf ( "Alt %d is: %s\n", mp->alt, name );
+	if ( ! strstr ( name, "RAM" ) ) {
+	    printf ( "That does not look like a RAM target, giving up\n" );
+	    return 1;
+	}
+	return 0;
+}
+
 /* The maple DFU loader has one interface.
+ * The transfer size and alt setting come from the device profile.
  */
-int
-maple_open ( struct maple_device *mp )
+static int
+maple_open_dev ( struct maple_device *mp )
 {
+	static __thread struct maple_profile *last_prof;
+	char name[256];
 	int s;
 
-	mp->xfer_size = MAPLE_XFER_SIZE;
+	mp->prof = profile_find ( mp->desc.idVendor, mp->desc.idProduct, mp->desc.bcdDevice );
+	if ( ! mp->prof )
+	    mp->prof = profile_default ( MAPLE_LOADER );
+	if ( verbose )
+	    printf ( "Using profile: %s\n", mp->prof->name );
+
+	status_open ( mp );
+	mp->polls = 0;
+	mp->retries = 0;
+	mp->last_status = 0;
+	mp->manifest_state = -1;
+	mp->t_manifest = 0;
+	mp->patch = NULL;
+	mp->layout.nrun = 0;
+
+	/* Same sort of board as last time, keep the deadlines we learned */
+	if ( mp->prof != last_prof )
+	    dfu_forget_deadlines ();
+	last_prof = mp->prof;
+	dfu_set_timeout ( mp->prof->dfu_timeout );
+	dfu_set_budget ( mp->prof->job_budget );
+
+	mp->xfer_size = mp->prof->xfer_size;
 	mp->interface = 0;
-	mp->alt = 1;
+	mp->alt = mp->prof->alt;
+
+	if ( ram_mode ) {
+	    if ( mp->prof->ram_alt < 0 ) {
+		printf ( "The %s profile has no RAM target\n", mp->prof->name );
+		return 1;
+	    }
+	    mp->alt = mp->prof->ram_alt;
+	}
 
 	mp->devh = NULL;
+
+	/* Simulated device, nothing to open */
+	if ( dfu_xfer_hook ) {
+	    if ( sim_active && sim_set_alt ( mp->alt ) < 0 ) {
+		printf ( "Maple open cannot do alt setting %d\n", mp->alt );
+		if ( ram_mode )
+		    printf ( "This loader does not have a RAM target\n" );
+		return 1;
+	    }
+	    mp->dfu_attr = sim_active ? sim_dfu_attr () : -1;
+	    return 0;
+	}
+
+	mp->dfu_attr = maple_dfu_attr ( mp );
+	if ( verbose && mp->dfu_attr >= 0 )
+	    printf ( "DFU attributes: 0x%02x%s%s\n", mp->dfu_attr,
+		mp->dfu_attr & USB_DFU_MANIFEST_TOL ? ", manifestation tolerant" : "",
+		mp->dfu_attr & USB_DFU_WILL_DETACH ? ", will detach" : "" );
+
 	s = libusb_open ( mp->dev, &mp->devh );
 	if ( s || ! mp->devh ) {
 	    printf ( "Maple open fails to open device\n" );
@@ -131,19 +273,77 @@ maple_open ( struct maple_device *mp )
 	s = libusb_set_interface_alt_setting ( mp->devh, mp->interface, mp->alt );
 	if ( s < 0 ) {
 	    printf ( "Maple open cannot do alt setting %d\n", mp->alt );
+	    if ( ram_mode )
+		printf ( "This loader does not have a RAM target\n" );
+	    return 1;
+	}
+
+	if ( ram_mode && maple_ram_check ( mp ) )
 	    return 1;
+
+	/* The ROM loader says how its flash is cut up (see dfuse.c) */
+	if ( mp->prof->proto == PROTO_DFUSE &&
+		maple_alt_name ( mp, mp->alt, name, sizeof(name) ) == 0 ) {
+	    dfuse_layout ( name, mp->prof->flash_base, &mp->layout );
+	    if ( verbose )
+		printf ( "Alt %d is: %s\n", mp->alt, name );
 	}
 
 	return 0;
 }
 
+/* Every device list goes through these two, to be counted.
+ * list is NULL if we did not get one, freeing that is fine.
+ */
+ssize_t
+maple_device_list ( libusb_context *context, libusb_device ***list )
+{
+	ssize_t ndev;
+
+	ndev = libusb_get_device_list ( context, list );
+	if ( ndev < 0 )
+	    *list = NULL;
+	else
+	    __sync_fetch_and_add ( &maple_lists, 1 );
+	return ndev;
+}
+
 void
-maple_close ( struct maple_device *mp )
+maple_free_list ( libusb_device **list )
+{
+	if ( ! list )
+	    return;
+	libusb_free_device_list ( list, 1 );
+	__sync_fetch_and_sub ( &maple_lists, 1 );
+}
+
+int
+maple_open ( struct maple_device *mp )
 {
-	libusb_release_interface ( mp->devh, mp->interface );
+	unsigned long long t0 = nano_time ();
+	int rv;
+
+	mp->is_open = 0;
+	rv = maple_open_dev ( mp );
+	timeline_span ( "maple_open", t0, nano_time () );
+	if ( rv == 0 ) {
+	    mp->is_open = 1;
+	    __sync_fetch_and_add ( &maple_handles, 1 );
+	}
+	return rv;
+}
 
-	if ( mp->devh )
+void
+maple_close ( struct maple_device *mp )
+{
+	if ( mp->is_open ) {
+	    mp->is_open = 0;
+	    __sync_fetch_and_sub ( &maple_handles, 1 );
+	}
+	if ( mp->devh ) {
+	    libusb_release_interface ( mp->devh, mp->interface );
 	    libusb_close ( mp->devh );
+	}
 	mp->devh = NULL;
 }
 
@@ -151,26 +351,162 @@ struct dfu_file file;
 
 int do_download = 1;
 
-int verbose = 0;
 int list_only = 0;
 
+int show_hist = 0;
+int watch_mode = 0;
+char *session_script = NULL;
+char *dump_file = NULL;
+char *audit_file = NULL;
+char *profile_file = NULL;
+char *capture_dir = NULL;
+int use_status = 0;
+char *history_file = NULL;
+char *history_name = NULL;
+char *bundle_file = NULL;
+int image_checks = 1;
+
+char *trace_file = NULL;
+char *timeline_file = NULL;
+char *cache_dir = NULL;
+char *patch_file = NULL;
+int soak_cycles = 0;
+char *replay_file = NULL;
+char *sim_spec = NULL;
+
+/* Boot confirmation, off unless asked for */
+int boot_deadline = 0;
+int boot_vendor = MAPLE_VENDOR;
+int boot_product = MAPLE_PROD_SERIAL;
+
+/* Default deadline if -B is given without -b */
+#define BOOT_DEADLINE	3000	/* ms */
+
+/* Options with an argument take it either from the rest of
+ * the word (-tfoo) or from the next word (-t foo).
+ */
+static char *
+opt_arg ( char *p, int *argc, char ***argv )
+{
+	if ( *p )
+	    return p;
+	if ( *argc <= 0 )
+	    error ( "Option is missing its argument" );
+	(*argc)--;
+	return *(*argv)++;
+}
+
+/* Say what find_maple() told us */
+static void
+show_mode ( int m )
+{
+	switch ( m ) {
+	    case MAPLE_SERIAL:
+		printf ( "Maple device in serial (application) mode\n" );
+		break;
+	    case MAPLE_LOADER:
+		printf ( "Maple device in DFU loader mode\n" );
+		break;
+	    case MAPLE_UNKNOWN:
+		printf ( "Maple device in some unknown mode !!?\n" );
+		break;
+	    case MAPLE_NONE:
+	    default:
+		printf ( "No maple device found\n" );
+		break;
+	}
+}
+
+/* More than one Maple plugged in */
+static void
+show_multiple ( int n )
+{
+	if ( n > 1 ) {
+	    printf ( "Warning !!!\n" );
+	    printf ( " multiple (namely %d) maple devices discovered\n", n );
+	    printf ( " the first encountered will be used, which may not be right\n" );
+	}
+}
+
+/* Download to a device that isn't really there: either a
+ * recorded trace (-r) or the simulated loader (-S) plays the part.
+ * No libusb at all here, so a run captured on a customer board
+ * can be profiled here, and new modes can be tried without hardware.
+ */
+static int
+simulated_download ( struct dfu_file *fp )
+{
+	struct maple_device maple_device;
+	unsigned long long t0;
+	int s;
+	int rv = 0;
+
+	memset ( &maple_device, 0, sizeof(maple_device) );
+	maple_device.desc.idVendor = MAPLE_VENDOR;
+	maple_device.desc.idProduct = MAPLE_PROD_LOADER;
+	timeline_name ( "simulated" );
+	if ( maple_open ( &maple_device ) ) {
+	    maple_close ( &maple_device );
+	    return 1;
+	}
+	if ( image_checks && image_check ( fp, maple_device.prof ) ) {
+	    printf ( "Not flashing %s (-f to flash it anyway)\n", fp->name );
+	    maple_close ( &maple_device );
+	    return 1;
+	}
+
+	t0 = nano_time ();
+	s = board_download ( &maple_device, fp );
+	if ( s != fp->size )
+	    rv = 1;
+	history_add ( &maple_device, NULL, "simulated", fp, s, 0, nano_time () - t0, 0, rv );
+	perform_reset ( &maple_device );
+	printf ( "Cycle took %.3f ms\n", (nano_time() - t0) / 1.0e6 );
+
+	maple_close ( &maple_device );
+	return rv;
+}
 
 /* Options - 
  *
  * -vvvv - set verbosity
- * -l = list only
+ * -l = list only (from sysfs, no libusb)
+ * -t file = record a trace of all control transfers to file
+ * -T file = write a timeline of the run to file, for chrome://tracing or Perfetto
+ * -r file = replay a recorded trace in place of a real device
+ * -S spec = use a simulated loader in place of a real device, see sim.c
+ * -k N = soak test, N download cycles against the simulated loader, see soak.c
+ * -R = load to RAM (alt 0) rather than flash, experimental
+ * -w = watch the file, reflash every time it changes
+ * -s script = run a session script (- for stdin), see session.c
+ * -d file = dump (upload) the flash contents to file
+ * -a file = audit all boards against file as the golden image
+ * -i file = flash every board with the image the bundle manifest file says
+ * -p file = read device profiles from file (default $HOME/.maple-util)
+ * -c dir = capture the serial output of every board to logs in dir
+ * -m = keep a status board in shared memory for monitors
+ * -M = show the status board and exit
+ * -j file = keep a history of every flash in file (and file.idx)
+ * -J name = show the history for a board or port, or "all" (needs -j)
+ * -b ms = after the reset, wait up to ms for the application to boot
+ * -B vid:pid = the application shows up as this (default 1eaf:0004)
+ * -f = flash even if the image does not look right, see image.c
+ * -C dir = keep prepared images in dir, shared by every maple-util, see cache.c
+ * -P file = give each board its own serial number and such from file, see patch.c
+ * -H = show latency histograms at the end
+ *      (kill -USR1 will show them at any time)
  */
 
 int
 main ( int argc, char **argv )
 {
-	struct maple_device maple_device;
 	libusb_context *context;
+	char profile_path[256];
 	int s;
-	char *ser;
 	int m;
 	int n;
 	char *p;
+	char *q;
 
 	file.name = NULL;
 
@@ -180,119 +516,524 @@ main ( int argc, char **argv )
 	    p = *argv++;
 	    if ( *p == '-' ) {
 		p++;
-		while ( *p && *p == 'v' ) {
-		    p++;
-		    verbose++;
+		while ( *p ) {
+		    switch ( *p++ ) {
+			case 'v':
+			    verbose++;
+			    break;
+			case 'l':
+			    list_only = 1;
+			    break;
+			case 'm':
+			    use_status = 1;
+			    break;
+			case 'M':
+			    return status_show ();
+			case 'i':
+			    bundle_file = opt_arg ( p, &argc, &argv );
+			    p = "";
+			    break;
+			case 'j':
+			    history_file = opt_arg ( p, &argc, &argv );
+			    p = "";
+			    break;
+			case 'J':
+			    history_name = opt_arg ( p, &argc, &argv );
+			    p = "";
+			    break;
+			case 'c':
+			    capture_dir = opt_arg ( p, &argc, &argv );
+			    p = "";
+			    break;
+			case 'p':
+			    profile_file = opt_arg ( p, &argc, &argv );
+			    p = "";
+			    break;
+			case 'a':
+			    audit_file = opt_arg ( p, &argc, &argv );
+			    p = "";
+			    break;
+			case 'd':
+			    dump_file = opt_arg ( p, &argc, &argv );
+			    p = "";
+			    break;
+			case 's':
+			    session_script = opt_arg ( p, &argc, &argv );
+			    p = "";
+			    break;
+			case 'w':
+			    watch_mode = 1;
+			    break;
+			case 'H':
+			    show_hist = 1;
+			    break;
+			case 'f':
+			    image_checks = 0;
+			    break;
+			case 'C':
+			    cache_dir = opt_arg ( p, &argc, &argv );
+			    p = "";
+			    break;
+			case 'P':
+			    patch_file = opt_arg ( p, &argc, &argv );
+			    p = "";
+			    break;
+			case 'b':
+			    boot_deadline = atoi ( opt_arg ( p, &argc, &argv ) );
+			    p = "";
+			    break;
+			case 'B':
+			    q = opt_arg ( p, &argc, &argv );
+			    p = "";
+			    if ( sscanf ( q, "%x:%x", &boot_vendor, &boot_product ) != 2 )
+				error ( "Want vid:pid for -B" );
+			    if ( ! boot_deadline )
+				boot_deadline = BOOT_DEADLINE;
+			    break;
+			case 't':
+			    trace_file = opt_arg ( p, &argc, &argv );
+			    p = "";
+			    break;
+			case 'T':
+			    timeline_file = opt_arg ( p, &argc, &argv );
+			    p = "";
+			    break;
+			case 'R':
+			    ram_mode = 1;
+			    break;
+			case 'S':
+			    sim_spec = opt_arg ( p, &argc, &argv );
+			    p = "";
+			    break;
+			case 'k':
+			    soak_cycles = atoi ( opt_arg ( p, &argc, &argv ) );
+			    p = "";
+			    break;
+			case 'r':
+			    replay_file = opt_arg ( p, &argc, &argv );
+			    p = "";
+			    break;
+			default:
+			    error ( "Unknown option" );
+		    }
 		}
-		if ( *p && *p == 'l' )
-		    list_only = 1;
 	    } else {
 		file.name = p;
 		printf ( "User filename: %s\n", file.name );
 	    }
 	}
 
-	s = libusb_init(&context);
-	if ( s )
-	    error ( "Cannot init libusb" );
+	hist_init ();
 
-	n = list_maple ( context, verbose );
-	if ( n > 1 ) {
-	    printf ( "Warning !!!\n" );
-	    printf ( " multiple (namely %d) maple devices discovered\n" );
-	    printf ( " the first encountered will be used, which may not be right\n" );
+	if ( timeline_file && timeline_open ( timeline_file ) )
+	    error ( "Abandoning ship" );
+
+	if ( use_status && status_init () )
+	    error ( "Abandoning ship" );
+
+	if ( history_name ) {
+	    if ( ! history_file )
+		error ( "-J needs a history file from -j" );
+	    return history_query ( history_file, history_name );
 	}
+	if ( history_file && history_open ( history_file ) )
+	    error ( "Abandoning ship" );
+	if ( cache_dir && cache_open ( cache_dir ) )
+	    error ( "Abandoning ship" );
+	if ( patch_file && patch_load ( patch_file ) )
+	    error ( "Abandoning ship" );
 
-	m = find_maple ( context, NULL );
+	if ( profile_file ) {
+	    if ( profile_load ( profile_file, 1 ) )
+		error ( "Abandoning ship" );
+	} else if ( getenv ( "HOME" ) ) {
+	    snprintf ( profile_path, sizeof(profile_path), "%s/.maple-util", getenv ( "HOME" ) );
+	    if ( profile_load ( profile_path, 0 ) )
+		error ( "Abandoning ship" );
+	}
 
-	switch ( m ) {
-	    case MAPLE_SERIAL:
-		printf ( "Maple device in serial (application) mode\n" );
-		break;
-	    case MAPLE_LOADER:
-		printf ( "Maple device in DFU loader mode\n" );
-		break;
-	    case MAPLE_UNKNOWN:
-		printf ( "Maple device in some unknown mode !!?\n" );
-		return 0;
-	    case MAPLE_NONE:
-	    default:
-		printf ( "No maple device found\n" );
-		return 0;
+	if ( replay_file || sim_spec ) {
+	    if ( ! file.name )
+		file.name = blink_file;
+	    if ( get_file ( &file ) ) {
+		printf ( "Cannot open file: %s\n", file.name );
+		error ( "Abandoning ship" );
+	    }
+	    if ( replay_file && trace_file )
+		error ( "Cannot record a trace while replaying one" );
+	    if ( replay_file && trace_replay_open ( replay_file ) )
+		error ( "Abandoning ship" );
+	    if ( sim_spec && sim_open ( sim_spec ) )
+		error ( "Abandoning ship" );
+	    if ( trace_file && trace_record_open ( trace_file ) )
+		error ( "Abandoning ship" );
+
+	    if ( soak_cycles )
+		s = soak_run ( &file, soak_cycles );
+	    else
+		s = simulated_download ( &file );
+	    trace_close ();
+	    timeline_close ();
+	    if ( show_hist )
+		hist_dump ( stdout );
+	    return s;
 	}
 
+	/* No libusb needed, just the ttys */
+	if ( capture_dir )
+	    return capture_serial ( capture_dir );
+
+	/* Just looking, sysfs is much quicker than libusb */
 	if ( list_only ) {
-	    // milli_sleep ( 100 );
-	    exit ( 0 );
+	    m = list_sysfs ( verbose, &n );
+	    show_multiple ( n );
+	    show_mode ( m );
+	    return 0;
 	}
 
-	file.name = blink_file;
+	s = libusb_init(&context);
+	if ( s )
+	    error ( "Cannot init libusb" );
+
+	n = list_maple ( context, verbose );
+	show_multiple ( n );
+
+	m = find_maple ( context, NULL );
+	show_mode ( m );
+
+	/* In watch mode it can show up later */
+	if ( m != MAPLE_SERIAL && m != MAPLE_LOADER && ! watch_mode )
+	    return 0;
 
-	if ( get_file ( &file ) ) {
-	    printf ( "Cannot open file: %s\n", file.name );
+	if ( trace_file && trace_record_open ( trace_file ) )
 	    error ( "Abandoning ship" );
+
+	if ( session_script )
+	    s = session_board ( context, m, session_script );
+	else if ( dump_file )
+	    s = dump_board ( context, m, dump_file );
+	else if ( audit_file ) {
+	    file.name = audit_file;
+	    if ( get_file ( &file ) ) {
+		printf ( "Cannot open file: %s\n", file.name );
+		error ( "Abandoning ship" );
+	    }
+	    s = audit_boards ( context, &file );
+	} else if ( bundle_file )
+	    s = bundle_boards ( context, bundle_file );
+	else {
+	    if ( ! file.name )
+		file.name = blink_file;
+
+	    if ( get_file ( &file ) ) {
+		printf ( "Cannot open file: %s\n", file.name );
+		error ( "Abandoning ship" );
+	    }
+	    if ( file.name && verbose )
+		printf ( "Read %d bytes from: %s\n", file.size, file.name );
+
+	    if ( watch_mode )
+		s = watch_file ( context, &file );
+	    else
+		s = flash_board ( context, m, &file );
 	}
-	if ( file.name && verbose )
-	    printf ( "Read %d bytes from: %s\n", file.size, file.name );
 
+	trace_close ();
+	timeline_close ();
+	if ( show_hist )
+	    hist_dump ( stdout );
+	libusb_exit(context);
+	if ( s )
+	    return 1;
+	printf ( "All done !!\n" );
+	return 0;
+}
+
+/* Kept from one flash to the next in watch mode, so we
+ * don't go looking through all the ttyACM devices every time.
+ */
+static char *last_serial = NULL;
+
+/* Get the board into the loader, fill in maple_device.
+ * m is what find_maple() last told us about the board.
+ * Returns 0 if all went well.
+ */
+int
+board_to_loader ( libusb_context *context, int m, struct maple_device *mp )
+{
+	struct maple_profile *pp;
+	char *ser;
 
 	if ( m == MAPLE_SERIAL ) {
-	    ser = find_maple_serial ();
-	    if ( ! ser ) 
-		printf ( "No maple device found\n" );
+	    /* The trigger timing comes from the serial side profile */
+	    pp = NULL;
+	    if ( find_maple ( context, mp ) == MAPLE_SERIAL ) {
+		pp = profile_find ( mp->desc.idVendor, mp->desc.idProduct, mp->desc.bcdDevice );
+		libusb_unref_device ( mp->dev );
+	    }
+	    if ( ! pp )
+		pp = profile_default ( MAPLE_SERIAL );
+
+	    if ( last_serial && serial_is_maple ( last_serial + strlen("/dev/") ) )
+		ser = last_serial;
 	    else
-		printf ( "Found maple device: %s\n", ser );
-	    if ( ! serial_trigger ( ser ) ) {
+		ser = find_maple_serial ();
+	    if ( ! ser ) {
+		printf ( "No maple device found\n" );
+		return 1;
+	    }
+	    printf ( "Found maple device: %s\n", ser );
+	    last_serial = ser;
+	    if ( ! serial_trigger ( ser, pp ) ) {
 		printf ( "Failed to trigger USB loader\n" );
-		exit ( 1 );
+		return 1;
 	    }
-	    wait_for_loader ( context );
+	    wait_for_loader ( context, pp );
 	}
 
 	/* Get maple device and verify we are in
 	 * DFU download mode.
 	 */
-	m = find_maple ( context, &maple_device );
+	m = find_maple ( context, mp );
 	if ( m != MAPLE_LOADER ) {
+	    if ( m != MAPLE_NONE )
+		libusb_unref_device ( mp->dev );
 	    printf ( "Not in DFU loader mode on final check\n" );
-	    exit ( 1 );
+	    return 1;
 	}
 
+	return 0;
+}
+
+/* Send the image to an open board, to flash or RAM,
+ * and say how long it took.  Returns bytes sent.
+ */
+int
+board_download ( struct maple_device *mp, struct dfu_file *fp )
+{
+	unsigned long long t0;
+	char *where;
+	int room;
+	int s;
+
+	if ( ram_mode ) {
+	    where = "RAM";
+	    room = mp->prof->ram_size;
+	} else {
+	    where = "flash";
+	    room = mp->prof->flash_size;
+	    /* The DfuSe loader knows better than the profile */
+	    if ( mp->prof->proto == PROTO_DFUSE && dfuse_flash_size ( mp ) >= 0 )
+		room = dfuse_flash_size ( mp );
+	}
+
+	/* A .dfu file says who it is for */
+	if ( suffix_check ( fp, mp ) )
+	    return 0;
+
+	if ( fp->size > room ) {
+	    printf ( "Image is %d bytes, %s only has room for %d in %s\n",
+		fp->size, mp->prof->name, room, where );
+	    return 0;
+	}
+
+	/* This board's serial number and such, with -P */
+	if ( patch_board ( mp, fp ) )
+	    return 0;
+
+	t0 = nano_time ();
+	if ( mp->prof->proto == PROTO_DFUSE )
+	    s = dfuse_do_dnload ( mp, fp );
+	else
+	    s = dfuload_do_dnload ( mp, fp );
+	patch_done ( mp, s == fp->size );
+	if ( s != fp->size ) {
+	    printf ( "Download gave trouble\n" );
+	    if ( ram_mode )
+		printf ( "This loader may not support RAM loads\n" );
+	}
+	if ( show_progress )
+	    printf ( "%d bytes sent to %s in %.3f ms\n", s, where, (nano_time() - t0) / 1.0e6 );
+	return s;
+}
+
+/* The profile the board will have once it is in the loader.
+ * A board in serial mode will come up in the Maple loader.
+ */
+static struct maple_profile *
+board_profile ( libusb_context *context, int m )
+{
+	struct maple_device md;
+	struct maple_profile *pp = NULL;
+
+	if ( m == MAPLE_LOADER && find_maple ( context, &md ) == MAPLE_LOADER ) {
+	    pp = profile_find ( md.desc.idVendor, md.desc.idProduct, md.desc.bcdDevice );
+	    libusb_unref_device ( md.dev );
+	}
+	if ( ! pp )
+	    pp = profile_default ( MAPLE_LOADER );
+	return pp;
+}
+
+/* The USB serial number, NULL if the board has nothing useful.
+ * The Maple loader says "LLM 003" for every board, which tells
+ * us nothing, so we don't count that.
+ */
+char *
+board_serial ( struct maple_device *mp )
+{
+	static __thread char serial[32];
+	int n;
+
+	if ( ! mp->devh || ! mp->desc.iSerialNumber )
+	    return NULL;
+	n = libusb_get_string_descriptor_ascii ( mp->devh, mp->desc.iSerialNumber,
+		(unsigned char *) serial, sizeof(serial) );
+	if ( n <= 0 || strcmp ( serial, "LLM 003" ) == 0 )
+	    return NULL;
+	return serial;
+}
+
+/* Get the board into the loader and send it the image.
+ * Returns 0 if all went well, 1 if the flash failed,
+ * 2 if the application did not come up after.
+ */
+int
+flash_board ( libusb_context *context, int m, struct dfu_file *fp )
+{
+	struct maple_device maple_device;
+	unsigned long long t0;
+	unsigned long long t_loader;
+	unsigned long long t_download = 0;
+	unsigned long long t_reset = 0;
+	unsigned long long t_boot = 0;
+	char port[32];
+	char *serial = NULL;
+	int s = 0;
+	int rv = 0;
+
+	/* Check the image before we bother the board */
+	if ( image_checks && image_check ( fp, board_profile ( context, m ) ) ) {
+	    printf ( "Not flashing %s (-f to flash it anyway)\n", fp->name );
+	    return 1;
+	}
+
+	t0 = nano_time ();
+	if ( board_to_loader ( context, m, &maple_device ) )
+	    return 1;
+	t_loader = nano_time () - t0;
+
 	if ( do_download ) {
 	    // pickle ( &maple_device );
+	    maple_port_path ( maple_device.dev, port );
+	    timeline_name ( port );
 	    s = maple_open ( &maple_device );
 	    if ( s == 0 ) {
-		s = dfuload_do_dnload ( &maple_device, &file);
-		if ( s != file.size )
-		    printf ( "Download gave trouble\n" );
-		printf ( "%d bytes sent\n", s );
+		if ( history_file )
+		    serial = board_serial ( &maple_device );
+		t0 = nano_time ();
+		s = board_download ( &maple_device, fp );
+		t_download = nano_time () - t0;
+		if ( s != fp->size )
+		    rv = 1;
+		t_reset = nano_time ();
 		perform_reset ( &maple_device );
+	    } else {
+		s = 0;
+		rv = 1;
 	    }
 	    maple_close ( &maple_device );
+
+	    /* Did the application come up ? */
+	    if ( rv == 0 && boot_deadline &&
+		    boot_confirm ( context, port, boot_vendor, boot_product, t_reset, boot_deadline, &t_boot ) )
+		rv = 2;
+
+	    history_add ( &maple_device, serial, port, fp, s, t_loader, t_download, t_boot, rv );
 	}
 
-	libusb_exit(context);
-	printf ( "All done !!\n" );
-	return 0;
+	libusb_unref_device ( maple_device.dev );
+	return rv;
+}
+
+void
+dump_report ( struct dfu_dump *dp )
+{
+	int i;
+	struct dfu_dump_run *rp;
+
+	printf ( "Hash %016llx, %d of %d bytes erased\n",
+	    (unsigned long long) dp->hash, dp->erased, dp->total );
+	for ( i=0; i<dp->nrun; i++ ) {
+	    rp = &dp->run[i];
+	    printf ( "  %05x - %05x  %s\n", rp->start, rp->start + rp->len - 1,
+		rp->erased ? "erased" : "data" );
+	}
+}
+
+/* Read flash back from the board into a file.
+ * We go until the loader gives us a short block.
+ */
+int
+dump_board ( libusb_context *context, int m, char *path )
+{
+	struct maple_device maple_device;
+	struct dfu_dump dump;
+	unsigned long long t0;
+	int fd;
+	int n = -1;
+
+	fd = open ( path, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+	if ( fd < 0 ) {
+	    printf ( "Cannot create file: %s\n", path );
+	    return 1;
+	}
+
+	if ( board_to_loader ( context, m, &maple_device ) ) {
+	    close ( fd );
+	    return 1;
+	}
+
+	if ( maple_open ( &maple_device ) == 0 ) {
+	    t0 = nano_time ();
+	    memset ( &dump, 0, sizeof(dump) );
+	    n = dfuload_do_upload ( &maple_device, 0, fd, &dump );
+	    if ( n >= 0 ) {
+		printf ( "%d bytes read to %s in %.3f seconds\n",
+		    n, path, (nano_time() - t0) / 1.0e9 );
+		dump_report ( &dump );
+	    }
+	    perform_reset ( &maple_device );
+	}
+	maple_close ( &maple_device );
+	libusb_unref_device ( maple_device.dev );
+	close ( fd );
+
+	return n < 0;
 }
 
 /* We usually see 1 0 0 2, i.e. we get the loader
  * after 0.4 seconds, even though we allow 1.0
+ * (or whatever the profile says)
  */
 
 int
-wait_for_loader ( libusb_context *context )
+wait_for_loader ( libusb_context *context, struct maple_profile *pp )
 {
+	unsigned long long t0 = nano_time ();
 	int m;
 	int i;
 
-	for ( i=0; i<10; i++ ) {
+	for ( i=0; i<pp->loader_wait; i += 100 ) {
 	    milli_sleep ( 100 );
 	    m = find_maple ( context, NULL );
 	    // printf ( "Maple mode: %d\n", m );
-	    if ( m == MAPLE_LOADER )
+	    if ( m == MAPLE_LOADER ) {
+		timeline_span ( "loader_wait", t0, nano_time () );
 		return 1;
+	    }
 	}
+	timeline_span ( "loader_wait", t0, nano_time () );
 	printf ( "Failed to enter loader mode\n" );
 	return 0;
 }
@@ -314,9 +1055,10 @@ wait_for_loader ( libusb_context *context )
  * This just does the magic trick as per the reset.py script
  */
 
-int
-serial_trigger ( char *path )
+static int
+serial_trigger_dev ( char *path, struct maple_profile *pp )
 {
+	int delay = pp->trigger_delay;
 	int fd;
 	int rts_flag = TIOCM_RTS;
 	int dtr_flag = TIOCM_DTR;
@@ -329,20 +1071,20 @@ serial_trigger ( char *path )
 	}
 
 	ioctl ( fd, TIOCMBIC, &rts_flag ); // RTS = 0
-	milli_sleep ( 10 );	/* 0.01 second */
+	milli_sleep ( delay );	/* 0.01 second */
 
 	ioctl ( fd, TIOCMBIC, &dtr_flag ); // DTR = 0
-	milli_sleep ( 10 );	/* 0.01 second */
+	milli_sleep ( delay );	/* 0.01 second */
 	ioctl ( fd, TIOCMBIS, &dtr_flag ); // DTR = 1
-	milli_sleep ( 10 );	/* 0.01 second */
+	milli_sleep ( delay );	/* 0.01 second */
 	ioctl ( fd, TIOCMBIC, &dtr_flag ); // DTR = 0
 
 	ioctl ( fd, TIOCMBIS, &rts_flag ); // RTS = 1
-	milli_sleep ( 10 );	/* 0.01 second */
+	milli_sleep ( delay );	/* 0.01 second */
 	ioctl ( fd, TIOCMBIS, &dtr_flag ); // DTR = 1
-	milli_sleep ( 10 );	/* 0.01 second */
+	milli_sleep ( delay );	/* 0.01 second */
 	ioctl ( fd, TIOCMBIC, &dtr_flag ); // DTR = 0
-	milli_sleep ( 10 );	/* 0.01 second */
+	milli_sleep ( delay );	/* 0.01 second */
 
 	n = write ( fd, "1EAF", 4 );
 	if ( n != 4 ) {
@@ -353,67 +1095,160 @@ serial_trigger ( char *path )
 	// printf ( "Serial trigger, write: %d\n", n );
 	/* Not buffered, no need to flush */
 
-	milli_sleep ( 100 );	/* 0.1 second */
+	milli_sleep ( pp->trigger_settle );	/* 0.1 second */
 	close(fd);
 
 	return 1;
 }
 
-#define DETACH_TIMEOUT	1000
+int
+serial_trigger ( char *path, struct maple_profile *pp )
+{
+	unsigned long long t0 = nano_time ();
+	int rv;
 
+	rv = serial_trigger_dev ( path, pp );
+	timeline_span ( "serial_trigger", t0, nano_time () );
+	return rv;
+}
+
+/* How the loader lets go depends on bitWillDetach (see
+ * maple_dfu_attr()).  One that will detach does it by itself when
+ * it gets DETACH, and the host must not reset it.  One that won't
+ * (the Maple) sits in dfuMANIFEST-WAIT-RESET after a download,
+ * waiting for a bus reset, and DETACH is not a request it takes
+ * in DFU mode, so we don't send it.  If we don't know, we do both.
+ */
 void
 perform_reset ( struct maple_device *mp )
 {
+	unsigned long long t0, t1;
+	int detach = 1;
+	int reset = 1;
 	int s;
 
-	printf ( "Performing device reset\n" );
+	/* The ROM loader left DFU mode on its own at the end of the download */
+	if ( mp->prof && mp->prof->proto == PROTO_DFUSE )
+	    return;
+
+	if ( mp->dfu_attr >= 0 ) {
+	    detach = (mp->dfu_attr & USB_DFU_WILL_DETACH) != 0;
+	    reset = ! detach;
+	}
+
+	if ( show_progress )
+	    printf ( "Performing device %s\n", reset ? "reset" : "detach" );
+	t0 = nano_time ();
 
-	s = dfu_detach ( mp->devh, mp->interface, DETACH_TIMEOUT );
-	if ( s < 0 )
-	    printf ( "Detach failed\n" );
+	/* If it won't take the DETACH, a reset is all we have left */
+	if ( detach ) {
+	    s = dfu_detach ( mp->devh, mp->interface, mp->prof->detach_timeout );
+	    if ( s < 0 ) {
+		printf ( "Detach failed\n" );
+		reset = 1;
+	    }
+	}
 
-	s = libusb_reset_device ( mp->devh );
-	if ( s < 0 )
-	    printf ( "Reset failed: %d\n", s );
+	/* Nothing to reset on a simulated device,
+	 * but the simulated loader should start over.
+	 */
+	if ( reset && dfu_xfer_hook ) {
+	    if ( sim_active )
+		sim_reset ();
+	} else if ( reset ) {
+	    s = libusb_reset_device ( mp->devh );
+	    if ( s < 0 )
+		printf ( "Reset failed: %d\n", s );
+	}
+	t1 = nano_time ();
+	timeline_span ( "perform_reset", t0, t1 );
+
+	/* The handoff, from the end of the data until the loader let go */
+	if ( mp->t_manifest ) {
+	    if ( hist_active )
+		hist_record ( mp->devh, HIST_HANDOFF, t1 - mp->t_manifest, 0 );
+	    if ( verbose )
+		printf ( "Handoff in %.3f ms (%s)\n", (t1 - mp->t_manifest) / 1.0e6,
+		    detach && reset ? "detach and reset" : detach ? "detach only" : "reset only" );
+	    mp->t_manifest = 0;
+	}
 }
 
-/* We don't read any fancy DFU format file,
- * just a binary image.
+/* A binary image, with or without a DFU suffix (see suffix.c),
+ * Intel HEX and S-records (see hexfile.c), or compressed with
+ * zstd or lz4 (see compress.c).  Give it back with put_file().
  */
 int
 get_file ( struct dfu_file *file )
+{
+	file->has_suffix = 0;
+	file->mapped = 0;
+	file->src = NULL;
+	if ( ! file->name )
+	    return 1;
+
+	return cache_get_file ( file, read_file );
+}
+
+static int
+read_file ( struct dfu_file *file )
 {
 	struct stat fstat;
 	int fd;
 	int n;
 
-	if ( ! file->name )
-	    return 1;
+	/* Still unpacking when we return, see compress.c */
+	if ( compress_format ( file->name ) )
+	    return compress_read ( file );
+
+	if ( hex_format ( file->name ) ) {
+	    if ( hex_read ( file ) )
+		return 1;
+	    file->digest = hash_buf ( file->buf, file->size );
+	    return 0;
+	}
 
 	if ( stat ( file->name, &fstat ) < 0 )
 	    return 1;
 
+	/* Watch mode may catch a file half written, so no error() here,
+	 * we let the caller decide whether that is the end of the world.
+	 */
 	file->size = fstat.st_size;
 	// printf ( "Stat gives: %d\n", fstat.st_size );
-	if ( file->size > 128 * 1024 )
-	    error ( "Input file too big" );
+	if ( file->size > 128 * 1024 ) {
+	    printf ( "Input file too big: %s\n", file->name );
+	    return 1;
+	}
 
-	/* We never free this, we just exit */
-	file->buf = malloc ( file->size );
-	if ( file->buf == NULL )
-	    error ( "Cannot allocate file buffer" );
+	/* Given back with put_file() */
+	file->buf = malloc ( file->size ? file->size : 1 );
+	if ( file->buf == NULL ) {
+	    printf ( "Cannot allocate file buffer\n" );
+	    return 1;
+	}
 
 	fd = open ( file->name, O_RDONLY );
 	if ( fd < 0 )
-	    return 1;
+	    goto bad;
 
 	n = read ( fd, file->buf, file->size );
 	// printf ( "read %d %d\n", n, file->size );
 	close ( fd );
-	if ( n != file->size )
-	    error ( "IO error reading file" );
+	if ( n != file->size ) {
+	    printf ( "IO error reading file: %s\n", file->name );
+	    goto bad;
+	}
 
+	if ( suffix_read ( file ) )
+	    goto bad;
+	file->digest = hash_buf ( file->buf, file->size );
 	return 0;
+
+bad:
+	free ( file->buf );
+	file->buf = NULL;
+	return 1;
 }
 
 #ifdef notdef
@@ -453,6 +1288,7 @@ get_string ( struct libusb_device *dev, int index )
 int
 list_maple ( libusb_context *context, int verb )
 {
+	struct maple_profile *pp;
 	struct libusb_device_descriptor desc;
 	struct libusb_device *dev;
 	libusb_device **list;
@@ -461,7 +1297,7 @@ list_maple ( libusb_context *context, int verb )
 	int s;
 	int num = 0;
 
-	ndev = libusb_get_device_list ( context, &list );
+	ndev = maple_device_list ( context, &list );
 	// printf ( "%d USB devices in list\n", ndev );
 
 	for ( i=0; i<ndev; i++ ) {
@@ -477,24 +1313,20 @@ list_maple ( libusb_context *context, int verb )
 		get_string (dev, desc.iManufacturer),
 		get_string (dev, desc.iProduct) );
 #endif
-	    if ( desc.idVendor != MAPLE_VENDOR ) {
-		if ( verb ) 
-		    printf("Vendor:Device = %04x:%04x\n", 
-			desc.idVendor, desc.idProduct );
-	    } else {
+	    pp = profile_find ( desc.idVendor, desc.idProduct, desc.bcdDevice );
+	    if ( pp ) {
 		num++;
-		if ( desc.idProduct == MAPLE_PROD_SERIAL )
-		    printf("Vendor:Device = %04x:%04x ---- Maple serial\n", 
-			desc.idVendor, desc.idProduct );
-		else if ( desc.idProduct == MAPLE_PROD_LOADER )
-		    printf("Vendor:Device = %04x:%04x ---- Maple loader\n", 
-			desc.idVendor, desc.idProduct );
-		else
-		    printf("Vendor:Device = %04x:%04x ---- Maple in unknown mode !?\n", 
-			desc.idVendor, desc.idProduct );
-	    }
+		printf("Vendor:Device = %04x:%04x ---- %s\n", 
+		    desc.idVendor, desc.idProduct, pp->name );
+	    } else if ( desc.idVendor == MAPLE_VENDOR ) {
+		num++;
+		printf("Vendor:Device = %04x:%04x ---- Maple in unknown mode !?\n", 
+		    desc.idVendor, desc.idProduct );
+	    } else if ( verb ) 
+		printf("Vendor:Device = %04x:%04x\n", 
+		    desc.idVendor, desc.idProduct );
 	}
-	libusb_free_device_list(list, 0);
+	maple_free_list ( list );
 	return num;
 }
 
@@ -514,7 +1346,7 @@ find_maple ( libusb_context *context, struct maple_device *mp )
 	int s;
 	int rv = MAPLE_NONE;
 
-	ndev = libusb_get_device_list ( context, &list );
+	ndev = maple_device_list ( context, &list );
 	// printf ( "%d USB devices in list\n", ndev );
 
 	for ( i=0; i<ndev; i++ ) {
@@ -524,17 +1356,11 @@ find_maple ( libusb_context *context, struct maple_device *mp )
 		// printf ( "device %2d, no descriptor\n", i );
 		continue;
 	    }
-	    if ( desc.idVendor != MAPLE_VENDOR )
+	    rv = profile_kind ( &desc );
+	    if ( rv == MAPLE_NONE )
 		continue;
 	    // printf("Vendor:Device = %04x:%04x\n", desc.idVendor, desc.idProduct );
 
-	    if ( desc.idProduct == MAPLE_PROD_SERIAL )
-		rv = MAPLE_SERIAL;
-	    else if ( desc.idProduct == MAPLE_PROD_LOADER )
-		rv = MAPLE_LOADER;
-	    else
-		rv = MAPLE_UNKNOWN;
-
 	    /* We call with this NULL sometimes, just to get the state info.
 	     */
 	    if ( mp ) {
@@ -543,13 +1369,87 @@ find_maple ( libusb_context *context, struct maple_device *mp )
 		memcpy ( &mp->desc, &desc, sizeof(desc) );
 	    }
 
+	    maple_free_list ( list );
 	    return rv;
 	}
 
-	libusb_free_device_list(list, 0);
+	maple_free_list ( list );
 	return MAPLE_NONE;
 }
 
+/* Like find_maple(), but get every Maple in loader mode,
+ * up to max of them.  Each one comes back with a reference
+ * held on the device, to be dropped with libusb_unref_device().
+ */
+int
+find_all_maple ( libusb_context *context, struct maple_device *mp, int max )
+{
+	struct libusb_device_descriptor desc;
+	struct libusb_device *dev;
+	libusb_device **list;
+	ssize_t ndev;
+	int i;
+	int num = 0;
+
+	ndev = maple_device_list ( context, &list );
+
+	for ( i=0; i<ndev && num < max; i++ ) {
+	    dev = list[i];
+	    if ( libusb_get_device_descriptor(dev, &desc) )
+		continue;
+	    if ( profile_kind ( &desc ) != MAPLE_LOADER )
+		continue;
+
+	    memset ( &mp[num], 0, sizeof(*mp) );
+	    mp[num].dev = libusb_ref_device ( dev );
+	    memcpy ( &mp[num].desc, &desc, sizeof(desc) );
+	    num++;
+	}
+
+	maple_free_list ( list );
+	return num;
+}
+
+/* Everyone in the loader?  Wait until we see as many
+ * loaders as we expect, or give up after a couple of seconds.
+ */
+int
+wait_all_loader ( libusb_context *context, int want )
+{
+	struct maple_device md[MAX_TTYACM];
+	unsigned long long t0 = nano_time ();
+	int n = 0;
+	int i, j;
+
+	for ( i=0; i<20; i++ ) {
+	    milli_sleep ( 100 );
+	    n = find_all_maple ( context, md, MAX_TTYACM );
+	    for ( j=0; j<n; j++ )
+		libusb_unref_device ( md[j].dev );
+	    if ( n >= want )
+		break;
+	}
+	timeline_span ( "loader_wait", t0, nano_time () );
+	return n;
+}
+
+/* Bus and port path, like "1-1.2", which is what sysfs calls
+ * the device too.  This stays the same when the board goes
+ * from serial to loader mode and back, unlike the address.
+ */
+void
+maple_port_path ( struct libusb_device *dev, char *path )
+{
+	unsigned char ports[8];
+	int n;
+	int i;
+
+	n = libusb_get_port_numbers ( dev, ports, sizeof(ports) );
+	sprintf ( path, "%d", libusb_get_bus_number ( dev ) );
+	for ( i=0; i<n; i++ )
+	    sprintf ( path + strlen(path), "%c%d", i ? '.' : '-', ports[i] );
+}
+
 /* The idea here is to open
  * /sys/class/tty/ttyACM0/device/uevent
  * And read something like this:
@@ -562,7 +1462,7 @@ MODALIAS=usb:v1EAFp0004d0200dc02dsc00dp00ic02isc02ip01in00
  *
  * The PRODUCT line is the thing, if it contains "1eaf/4" you got it.
  */
-static int
+int
 serial_is_maple ( char *dev )
 {
 	char path[100];
@@ -623,6 +1523,28 @@ find_maple_serial ( void )
 	return NULL;
 }
 
+/* Kick every Maple we find running its application into
+ * the loader.  Returns how many we kicked.
+ */
+int
+trigger_all_serial ( void )
+{
+	char dev[32];
+	char dev2[20];
+	int i;
+	int num = 0;
+
+	for ( i=0; i<MAX_TTYACM; i++ ) {
+	    sprintf ( dev2, "ttyACM%d", i );
+	    if ( ! serial_is_maple ( dev2 ) )
+		continue;
+	    sprintf ( dev, "/dev/%s", dev2 );
+	    if ( serial_trigger ( dev, profile_default ( MAPLE_SERIAL ) ) )
+		num++;
+	}
+	return num;
+}
+
 #ifdef notdef
 /* from usb_dfu.h */
 struct usb_dfu_func_descriptor {
@@ -777,6 +1699,17 @@ milli_sleep ( int msec )
 	nanosleep ( &ns_delay, NULL);
 }
 
+/* Monotonic time in nanoseconds, for timing things.
+ */
+unsigned long long
+nano_time ( void )
+{
+	struct timespec ts;
+
+	clock_gettime ( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 /* Stub for now */
 void
 dfu_progress_bar(const char *desc, unsigned long long curr,
@@ -1,17 +1,258 @@
+struct chunk_src;
+struct patch_set;
+
 struct dfu_file {
     /* File name */
     char *name;
     /* Pointer to file loaded into memory */
     char *buf;
     int size;
+    /* From the DFU suffix, if it had one (see suffix.c) */
+    int has_suffix;
+    int suffix_vendor;
+    int suffix_product;
+    int suffix_bcd;
+    /* hash_buf() of the image, for verify and history */
+    unsigned long long digest;
+    /* Length of the mapping if buf is in the image cache (see cache.c), else 0 */
+    int mapped;
+    /* Still being unpacked into buf, if compressed (see compress.c) */
+    struct chunk_src *src;
+};
+
+#define MAPLE_VENDOR		0x1eaf
+#define MAPLE_PROD_LOADER	3
+#define MAPLE_PROD_SERIAL	4
+
+#define MAPLE_XFER_SIZE		1024
+
+/* See profile.c for what all these are */
+#define PROFILE_ANY	-1
+
+#define PROTO_DFU	0	/* plain DFU, the Maple loader */
+#define PROTO_DFUSE	1	/* ST DfuSe, the STM32 ROM loader */
+
+struct maple_profile {
+	char name[32];
+	int vendor;
+	int product;
+	int bcd;		/* bcdDevice, or PROFILE_ANY */
+	int kind;		/* MAPLE_LOADER or MAPLE_SERIAL */
+	int xfer_size;
+	int alt;
+	unsigned int flash_base;
+	int flash_size;
+	int poll_timeout;	/* ms, -1 to use bwPollTimeout */
+	int detach_timeout;	/* ms */
+	int dfu_timeout;	/* ms */
+	int trigger_delay;	/* ms */
+	int trigger_settle;	/* ms */
+	int loader_wait;	/* ms */
+	int ram_alt;		/* -1 if no RAM target */
+	unsigned int ram_base;
+	int ram_size;
+	int proto;		/* PROTO_DFU or PROTO_DFUSE */
+	int page_size;		/* flash erase page, for DfuSe */
+	unsigned int sram_base;	/* all of SRAM, for checking images */
+	int sram_size;
+	int job_budget;		/* ms for one board, 0 for no limit */
+};
+
+/* How DfuSe flash is cut into sectors, from the alt setting
+ * name (see dfuse.c): count[i] sectors of size[i] bytes, in order.
+ */
+#define DFUSE_MAX_RUNS	8
+
+struct dfuse_layout {
+	unsigned int base;
+	int nrun;		/* 0 if we don't know */
+	int count[DFUSE_MAX_RUNS];
+	int size[DFUSE_MAX_RUNS];
 };
 
 struct maple_device {
 	struct libusb_device *dev;
 	struct libusb_device_descriptor desc;
 	libusb_device_handle *devh;
+	struct maple_profile *prof;
 	int xfer_size;
 	int interface;
 	int alt;
+	struct status_slot *slot;	/* see status.c */
+	int polls;			/* GETSTATUS requests */
+	int retries;
+	int last_status;		/* bStatus from the last GETSTATUS */
+	int is_open;
+	int dfu_attr;			/* bmAttributes, -1 if unknown */
+	int manifest_state;		/* where the download left it, -1 if not done */
+	unsigned long long t_manifest;	/* when the manifest phase began */
+	struct patch_set *patch;	/* this board's own bytes (see patch.c) */
+	char *patch_buf;
+	struct dfuse_layout layout;	/* DfuSe flash sectors */
+};
+
+
+/* What we learned while reading back flash.
+ * The runs describe which parts were erased (all 0xff),
+ * at transfer block granularity.
+ */
+#define DUMP_MAX_RUNS	32
+
+struct dfu_dump_run {
+	int start;
+	int len;
+	int erased;
 };
 
+struct dfu_dump {
+	int total;
+	int erased;
+	uint64_t hash;
+	int nrun;
+	struct dfu_dump_run run[DUMP_MAX_RUNS];
+	/* If the caller provides this, we also hash each block */
+	uint64_t *block_hash;
+	int max_blocks;
+	int nblocks;
+};
+
+/* return codes from find_maple()
+ * could be an enum, but I'm too lazy
+ */
+#define MAPLE_NONE	0
+#define MAPLE_SERIAL	1
+#define MAPLE_LOADER	2
+#define MAPLE_UNKNOWN	3
+
+/* in main.c */
+int find_maple ( libusb_context *, struct maple_device * );
+int board_to_loader ( libusb_context *, int, struct maple_device * );
+int flash_board ( libusb_context *, int, struct dfu_file * );
+char *board_serial ( struct maple_device * );
+int board_download ( struct maple_device *, struct dfu_file * );
+int maple_open ( struct maple_device * );
+void maple_close ( struct maple_device * );
+void perform_reset ( struct maple_device * );
+int find_all_maple ( libusb_context *, struct maple_device *, int );
+ssize_t maple_device_list ( libusb_context *, libusb_device *** );
+void maple_free_list ( libusb_device ** );
+int wait_all_loader ( libusb_context *, int );
+void maple_port_path ( struct libusb_device *, char * );
+int trigger_all_serial ( void );
+int serial_is_maple ( char * );
+int get_file ( struct dfu_file * );
+int dump_board ( libusb_context *, int, char * );
+void dump_report ( struct dfu_dump * );
+void milli_sleep ( int );
+unsigned long long nano_time ( void );
+
+/* in dfu_load.c */
+int dfuload_do_dnload ( struct maple_device *, struct dfu_file * );
+int dfuload_do_upload_buf ( struct maple_device *, unsigned char *, int );
+int dfuload_do_upload ( struct maple_device *, int, int, struct dfu_dump * );
+
+/* in audit.c */
+int audit_boards ( libusb_context *, struct dfu_file * );
+
+/* in profile.c */
+struct maple_profile *profile_find ( int, int, int );
+struct maple_profile *profile_default ( int );
+int profile_kind ( struct libusb_device_descriptor * );
+int profile_load ( char *, int );
+
+/* in dfuse.c */
+int dfuse_set_address ( struct maple_device *, unsigned int );
+int dfuse_upload_start ( struct maple_device * );
+int dfuse_do_dnload ( struct maple_device *, struct dfu_file * );
+void dfuse_layout ( char *, unsigned int, struct dfuse_layout * );
+int dfuse_flash_size ( struct maple_device * );
+
+/* in boot.c */
+int boot_confirm ( libusb_context *, char *, int, int, unsigned long long, int, unsigned long long * );
+
+/* in capture.c */
+int capture_serial ( char * );
+
+/* in sysfs.c */
+int list_sysfs ( int, int * );
+
+/* in status.c */
+extern int status_active;
+int status_init ( void );
+void status_open ( struct maple_device * );
+void status_start ( struct maple_device *, int );
+void status_bytes ( struct maple_device *, int );
+void status_state ( struct maple_device *, int, int );
+void status_error ( struct maple_device *, char * );
+void status_retry ( struct maple_device * );
+int status_show ( void );
+
+/* in history.c */
+int history_open ( char * );
+void history_add ( struct maple_device *, char *, char *, struct dfu_file *,
+	int, unsigned long long, unsigned long long, unsigned long long, int );
+int history_query ( char *, char * );
+
+/* in bundle.c */
+int bundle_boards ( libusb_context *, char * );
+
+/* in image.c */
+int image_check ( struct dfu_file *, struct maple_profile * );
+
+/* in hexfile.c */
+int hex_format ( char * );
+int hex_read ( struct dfu_file * );
+
+/* in suffix.c */
+int suffix_read ( struct dfu_file * );
+int suffix_check ( struct dfu_file *, struct maple_device * );
+uint32_t crc32_update ( uint32_t, const unsigned char *, int );
+
+/* in timeline.c */
+extern int timeline_active;
+int timeline_open ( char * );
+void timeline_name ( char * );
+void timeline_span ( const char *, unsigned long long, unsigned long long );
+void timeline_close ( void );
+
+/* in soak.c */
+int soak_run ( struct dfu_file *, int );
+
+/* in cache.c */
+int cache_open ( char * );
+int cache_get_file ( struct dfu_file *, int (*) ( struct dfu_file * ) );
+void put_file ( struct dfu_file * );
+
+/* in compress.c */
+int compress_format ( char * );
+int compress_read ( struct dfu_file * );
+int chunk_wait ( struct dfu_file *, int );
+int file_wait ( struct dfu_file * );
+void compress_done ( struct dfu_file * );
+
+/* in patch.c */
+int patch_load ( char * );
+int patch_board ( struct maple_device *, struct dfu_file * );
+char *patch_chunk ( struct maple_device *, struct dfu_file *, int, int );
+void patch_done ( struct maple_device *, int );
+
+/* in sim.c */
+#define SIM_STALL	0
+#define SIM_TIMEOUT	1
+#define SIM_ERROR	2
+#define SIM_VANISH	3
+#define SIM_HANG	4
+#define SIM_NFAULT	5
+
+extern int sim_active;
+extern int sim_faults[SIM_NFAULT];
+int sim_open ( char * );
+int sim_set_alt ( int );
+void sim_reset ( void );
+int sim_dfu_attr ( void );
+
+/* in session.c */
+int session_board ( libusb_context *, int, char * );
+
+/* in watch.c */
+int watch_file ( libusb_context *, struct dfu_file * );
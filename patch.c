@@ -0,0 +1,445 @@
+/* patch.c - maple-util
+ *
+ * Personalization.  Every board gets the same base image, plus a
+ * few bytes of its own: a serial number, a calibration block.
+ * With -P file, those come from a patch file, lines like:
+ *
+ *   # CRC-32 of 0x7c00 up to 0x7ffc, kept at 0x7ffc
+ *   crc 0x7ffc 0x7c00 0x7ffc
+ *
+ *   serial=MC0012	0x400=s:SN-000123 0x7c00=u32:1234 0x7c04=x:00ff10a0
+ *   port=1-1.2		0x400=s:SN-000124 0x7c00=u32:1187
+ *   next		0x400=s:SN-000125 0x7c00=u32:1201
+ *
+ * A board matches a patch set by USB serial number, then by port
+ * path, and if neither, takes the next unused "next" set, so a run
+ * that flashes a rack (or boards one after another in watch mode)
+ * gives each its own.  A "next" set stays with the board it went to
+ * (by serial number, or port if it has none), so flashing that board
+ * again, as watch mode does on every rebuild, gives it the same one.
+ * If the first download with a set fails, the set goes back.
+ * A board with no patch set is not flashed.
+ *
+ * Offsets are from the start of the image, and no more than 2M.  Values are s:text
+ * (just the bytes, add x:00 if you want it terminated), x:hex bytes,
+ * or u8:, u16:, u32: numbers, little endian like the STM32.
+ * The crc line is optional, if given, every board gets a CRC-32
+ * (as zlib) of that range, with its patches in, stored little endian.
+ *
+ * Nothing is copied or written to disk per board.  The download
+ * asks us for each transfer (patch_chunk), and gets the shared image
+ * unless one of the board's patches falls in it, in which case it
+ * gets a copy of just that transfer, with the patches laid over it.
+ * The base image, and its digest in the history, stay the same,
+ * so "verify" in a session compares against the base image.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include <libusb.h>
+
+#include "maple.h"
+
+#define MAX_PATCH_SETS		256
+#define MAX_PATCH_FIELDS	16	/* per board, the CRC is one */
+#define MAX_PATCH_BYTES		256	/* per board, all fields */
+#define MAX_PATCH_OFFSET	(2 * 1024 * 1024)	/* biggest STM32 flash */
+
+#define MATCH_SERIAL	0
+#define MATCH_PORT	1
+#define MATCH_NEXT	2
+
+extern int verbose;
+
+struct patch_field {
+	int offset;
+	int len;
+	unsigned char *data;
+};
+
+struct patch_set {
+	int how;
+	char key[32];
+	int used;
+	char owner[32];		/* who a "next" set went to */
+	int flashed;		/* a download with it went through */
+	int nfield;
+	struct patch_field field[MAX_PATCH_FIELDS];
+	int nbytes;
+	unsigned char bytes[MAX_PATCH_BYTES];
+};
+
+static struct patch_set sets[MAX_PATCH_SETS];
+static int nsets;
+
+/* Where the CRC goes, and what it covers, crc_at < 0 if none */
+static int crc_at = -1;
+static int crc_start;
+static int crc_end;
+
+static pthread_mutex_t patch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Room for n more bytes in this set */
+static unsigned char *
+patch_room ( struct patch_set *ps, int n )
+{
+	unsigned char *p;
+
+	if ( ps->nfield == MAX_PATCH_FIELDS || ps->nbytes + n > MAX_PATCH_BYTES )
+	    return NULL;
+	p = &ps->bytes[ps->nbytes];
+	ps->nbytes += n;
+	ps->field[ps->nfield].len = n;
+	ps->field[ps->nfield].data = p;
+	return p;
+}
+
+static int
+hex_nibble ( int c )
+{
+	if ( c >= '0' && c <= '9' )
+	    return c - '0';
+	if ( c >= 'a' && c <= 'f' )
+	    return c - 'a' + 10;
+	if ( c >= 'A' && c <= 'F' )
+	    return c - 'A' + 10;
+	return -1;
+}
+
+/* One offset=value, returns 0 if it made sense */
+static int
+patch_field ( struct patch_set *ps, char *tok )
+{
+	unsigned char *p;
+	unsigned long val;
+	char *end;
+	char *v;
+	long offset;
+	int n;
+	int i;
+
+	offset = strtol ( tok, &end, 0 );
+	if ( end == tok || *end != '=' || offset < 0 || offset > MAX_PATCH_OFFSET )
+	    return 1;
+	v = end + 1;
+
+	if ( strncmp ( v, "s:", 2 ) == 0 ) {
+	    n = strlen ( v + 2 );
+	    if ( n == 0 || ! (p = patch_room ( ps, n )) )
+		return 1;
+	    memcpy ( p, v + 2, n );
+	} else if ( strncmp ( v, "x:", 2 ) == 0 ) {
+	    v += 2;
+	    n = strlen ( v ) / 2;
+	    if ( n == 0 || strlen ( v ) % 2 || ! (p = patch_room ( ps, n )) )
+		return 1;
+	    for ( i=0; i<n; i++ ) {
+		if ( hex_nibble ( v[2*i] ) < 0 || hex_nibble ( v[2*i+1] ) < 0 )
+		    return 1;
+		p[i] = hex_nibble ( v[2*i] ) << 4 | hex_nibble ( v[2*i+1] );
+	    }
+	} else if ( v[0] == 'u' ) {
+	    n = strtol ( v + 1, &end, 10 ) / 8;
+	    if ( (n != 1 && n != 2 && n != 4) || *end != ':' )
+		return 1;
+	    v = end + 1;
+	    val = strtoul ( v, &end, 0 );
+	    if ( end == v || *end || ! (p = patch_room ( ps, n )) )
+		return 1;
+	    for ( i=0; i<n; i++ )
+		p[i] = val >> (8 * i);
+	} else
+	    return 1;
+
+	ps->field[ps->nfield++].offset = offset;
+	return 0;
+}
+
+/* Returns 0 if the patch file made sense.
+ */
+int
+patch_load ( char *path )
+{
+	char line[1024];
+	struct patch_set *ps;
+	char *tok;
+	long at, start, end;
+	FILE *fp;
+	int lnum = 0;
+	int i;
+
+	fp = fopen ( path, "r" );
+	if ( ! fp ) {
+	    printf ( "Cannot open patch file: %s\n", path );
+	    return 1;
+	}
+
+	while ( fgets ( line, sizeof(line), fp ) ) {
+	    lnum++;
+	    tok = strtok ( line, " \t\n" );
+	    if ( ! tok || *tok == '#' )
+		continue;
+
+	    if ( strcmp ( tok, "crc" ) == 0 ) {
+		tok = strtok ( NULL, "" );
+		if ( ! tok || sscanf ( tok, "%li %li %li", &at, &start, &end ) != 3 ||
+			at < 0 || at > MAX_PATCH_OFFSET || start < 0 ||
+			end <= start || end > MAX_PATCH_OFFSET ||
+			(at + 4 > start && at < end) )
+		    goto bad;
+		crc_at = at;
+		crc_start = start;
+		crc_end = end;
+		continue;
+	    }
+
+	    if ( nsets == MAX_PATCH_SETS )
+		goto bad;
+	    ps = &sets[nsets];
+	    memset ( ps, 0, sizeof(*ps) );
+	    if ( strncmp ( tok, "serial=", 7 ) == 0 ) {
+		ps->how = MATCH_SERIAL;
+		snprintf ( ps->key, sizeof(ps->key), "%s", tok + 7 );
+	    } else if ( strncmp ( tok, "port=", 5 ) == 0 ) {
+		ps->how = MATCH_PORT;
+		snprintf ( ps->key, sizeof(ps->key), "%s", tok + 5 );
+	    } else if ( strcmp ( tok, "next" ) == 0 )
+		ps->how = MATCH_NEXT;
+	    else
+		goto bad;
+
+	    while ( (tok = strtok ( NULL, " \t\n" )) )
+		if ( patch_field ( ps, tok ) )
+		    goto bad;
+	    if ( ps->nfield == 0 )
+		goto bad;
+	    nsets++;
+	}
+	fclose ( fp );
+
+	if ( nsets == 0 ) {
+	    printf ( "Nothing in patch file %s\n", path );
+	    return 1;
+	}
+
+	/* The CRC is one more field, filled in for each board.
+	 * Make the tables now, before there are any worker threads.
+	 */
+	if ( crc_at >= 0 ) {
+	    crc32_update ( 0, NULL, 0 );
+	    for ( i=0; i<nsets; i++ ) {
+		if ( ! patch_room ( &sets[i], 4 ) ) {
+		    printf ( "Patch set %d has no room left for the CRC\n", i + 1 );
+		    return 1;
+		}
+		sets[i].field[sets[i].nfield++].offset = crc_at;
+	    }
+	}
+	return 0;
+
+bad:
+	printf ( "Bad line %d in patch file %s\n", lnum, path );
+	fclose ( fp );
+	return 1;
+}
+
+/* The board's own set, or the "next" set it already has,
+ * or else a free "next" set, which is now its own.
+ */
+static struct patch_set *
+patch_find ( char *serial, char *port )
+{
+	struct patch_set *ps = NULL;
+	char *owner = serial ? serial : port;
+	int how;
+	int i;
+
+	pthread_mutex_lock ( &patch_lock );
+	for ( how = MATCH_SERIAL; how <= MATCH_NEXT && ! ps; how++ ) {
+	    for ( i=0; i<nsets; i++ ) {
+		if ( sets[i].how != how )
+		    continue;
+		if ( how == MATCH_SERIAL && (! serial || strcmp ( sets[i].key, serial ) != 0) )
+		    continue;
+		if ( how == MATCH_PORT && strcmp ( sets[i].key, port ) != 0 )
+		    continue;
+		if ( how == MATCH_NEXT && (! sets[i].used || strcmp ( sets[i].owner, owner ) != 0) )
+		    continue;
+		ps = &sets[i];
+		break;
+	    }
+	}
+	for ( i=0; i<nsets && ! ps; i++ ) {
+	    if ( sets[i].how == MATCH_NEXT && ! sets[i].used ) {
+		ps = &sets[i];
+		ps->used = 1;
+		snprintf ( ps->owner, sizeof(ps->owner), "%s", owner );
+	    }
+	}
+	pthread_mutex_unlock ( &patch_lock );
+	return ps;
+}
+
+/* A "next" set that never got onto its board can go to another */
+static void
+patch_release ( struct patch_set *ps )
+{
+	pthread_mutex_lock ( &patch_lock );
+	if ( ps->how == MATCH_NEXT && ! ps->flashed ) {
+	    ps->used = 0;
+	    ps->owner[0] = '\0';
+	}
+	pthread_mutex_unlock ( &patch_lock );
+}
+
+/* n bytes of the image from off, with the first nfield patches
+ * laid over them.  If none fall in there, that is just the shared
+ * image, otherwise a copy in buf.
+ */
+static char *
+patch_overlay ( struct patch_set *ps, int nfield, struct dfu_file *fp, int off, int n, char *buf )
+{
+	struct patch_field *pf;
+	char *src = fp->buf + off;
+	int copied = 0;
+	int lo, hi;
+	int i;
+
+	for ( i=0; i<nfield; i++ ) {
+	    pf = &ps->field[i];
+	    lo = pf->offset > off ? pf->offset : off;
+	    hi = pf->offset + pf->len < off + n ? pf->offset + pf->len : off + n;
+	    if ( lo >= hi )
+		continue;
+	    if ( ! copied ) {
+		memcpy ( buf, src, n );
+		copied = 1;
+	    }
+	    memcpy ( buf + lo - off, pf->data + lo - pf->offset, hi - lo );
+	}
+	return copied ? buf : src;
+}
+
+/* The CRC, of the image as this board will have it */
+static void
+patch_crc ( struct patch_set *ps, struct dfu_file *fp )
+{
+	struct patch_field *pf = &ps->field[ps->nfield - 1];
+	char buf[MAPLE_XFER_SIZE];
+	uint32_t crc = 0xffffffff;
+	char *p;
+	int off;
+	int n;
+	int i;
+
+	for ( off = crc_start; off < crc_end; off += n ) {
+	    n = crc_end - off;
+	    if ( n > sizeof(buf) )
+		n = sizeof(buf);
+	    p = patch_overlay ( ps, ps->nfield - 1, fp, off, n, buf );
+	    crc = crc32_update ( crc, (unsigned char *) p, n );
+	}
+	crc = ~crc;
+	for ( i=0; i<4; i++ )
+	    pf->data[i] = crc >> (8 * i);
+}
+
+/* Find this board's patch set and get it ready for the download.
+ * Returns 0 if all is well (or we aren't patching at all).
+ */
+int
+patch_board ( struct maple_device *mp, struct dfu_file *fp )
+{
+	struct patch_set *ps;
+	char port[32];
+	char *serial;
+	int i;
+
+	mp->patch = NULL;
+	mp->patch_buf = NULL;
+	if ( ! nsets )
+	    return 0;
+
+	serial = board_serial ( mp );
+	if ( mp->dev )
+	    maple_port_path ( mp->dev, port );
+	else
+	    strcpy ( port, "simulated" );
+
+	ps = patch_find ( serial, port );
+	if ( ! ps ) {
+	    printf ( "No patch set for board %s at %s, not flashing it\n",
+		serial ? serial : "-", port );
+	    return 1;
+	}
+
+	for ( i=0; i<ps->nfield; i++ ) {
+	    if ( ps->field[i].offset + ps->field[i].len > fp->size ) {
+		printf ( "Patch at 0x%x is past the end of %s (%d bytes)\n",
+		    ps->field[i].offset, fp->name, fp->size );
+		goto bad;
+	    }
+	}
+	if ( crc_at >= 0 ) {
+	    if ( crc_end > fp->size ) {
+		printf ( "CRC range runs past the end of %s (%d bytes)\n", fp->name, fp->size );
+		goto bad;
+	    }
+	    if ( file_wait ( fp ) )
+		goto bad;
+	    patch_crc ( ps, fp );
+	}
+
+	mp->patch_buf = malloc ( mp->xfer_size );
+	if ( ! mp->patch_buf )
+	    goto bad;
+	mp->patch = ps;
+
+	if ( verbose ) {
+	    printf ( "Patch set for %s: %d fields, %d bytes", ps->how == MATCH_NEXT ? "next board" : ps->key,
+		ps->nfield, ps->nbytes );
+	    if ( crc_at >= 0 )
+		printf ( ", CRC %02x%02x%02x%02x at 0x%x", ps->field[ps->nfield-1].data[3],
+		    ps->field[ps->nfield-1].data[2], ps->field[ps->nfield-1].data[1],
+		    ps->field[ps->nfield-1].data[0], crc_at );
+	    printf ( "\n" );
+	}
+	return 0;
+
+bad:
+	patch_release ( ps );
+	return 1;
+}
+
+/* What to send for the n bytes at off, for this board.
+ */
+char *
+patch_chunk ( struct maple_device *mp, struct dfu_file *fp, int off, int n )
+{
+	if ( ! mp->patch )
+	    return fp->buf + off;
+	return patch_overlay ( mp->patch, mp->patch->nfield, fp, off, n, mp->patch_buf );
+}
+
+/* ok if the download went through, if not,
+ * a "next" set it had just been given goes back.
+ */
+void
+patch_done ( struct maple_device *mp, int ok )
+{
+	if ( mp->patch && ok ) {
+	    pthread_mutex_lock ( &patch_lock );
+	    mp->patch->flashed = 1;
+	    pthread_mutex_unlock ( &patch_lock );
+	} else if ( mp->patch )
+	    patch_release ( mp->patch );
+	free ( mp->patch_buf );
+	mp->patch_buf = NULL;
+	mp->patch = NULL;
+}
+
+/* THE END */
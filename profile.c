@@ -0,0 +1,352 @@
+/* profile.c - maple-util
+ *
+ * Device profiles.  Everything we used to wire in for the Maple
+ * (transfer size, alt setting, flash layout, timeouts, and the
+ * timing of the serial trigger) lives in a table here, keyed by
+ * USB vendor, product and bcdDevice.  Clone boards and patched
+ * loaders that want different numbers get their own entry.
+ *
+ * Entries can be added or overridden from a config file
+ * ($HOME/.maple-util, or -p file), one per line:
+ *
+ *   # vid:pid:bcd  key=value ...
+ *   1eaf:0003:0201 name=olimexino poll=2 timeout=500
+ *   1eaf:0003:*    xfer=1024 alt=1
+ *
+ * A config entry starts out as a copy of whatever built in entry
+ * matches its vid:pid, so only the differences need be given.
+ * The keys are:
+ *
+ *   name	- shown in listings
+ *   kind	- loader or serial
+ *   xfer	- DFU transfer size, 1 to 4096
+ *   alt	- alt setting to use for flashing
+ *   base	- flash address the loader writes to
+ *   size	- bytes of flash available there
+ *   poll	- ms to wait between GETSTATUS, ignoring
+ *		  what the device says in bwPollTimeout (-1 to believe it)
+ *		  This is the QUIRK_POLLTIMEOUT idea from dfu-util.
+ *   detach	- wTimeout for DFU_DETACH, in ms
+ *   timeout	- USB control transfer timeout, in ms.  This is the
+ *		  most any request gets, see the deadlines in dfu.c
+ *   budget	- ms allowed for one board, open to reset (0 for no limit)
+ *   trigger	- ms between modem control changes in the serial trigger
+ *   settle	- ms to wait after the trigger before we let go of the tty
+ *   wait	- ms to wait for the loader to show up after the trigger
+ *   ramalt	- alt setting that loads to RAM (-1 for none)
+ *   rambase	- RAM address the loader writes to
+ *   ramsize	- bytes of RAM available there
+ *   proto	- dfu or dfuse (the STM32 ROM loader)
+ *   page	- flash page size, for DfuSe when the loader does not say
+ *   sram	- where SRAM starts, images must put the stack there
+ *   sramsize	- how much SRAM
+ *
+ * Numbers must be just that, sizes and times can't be negative.
+ * A bad one gets the line rejected.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libusb.h>
+
+#include "maple.h"
+
+#define MAX_PROFILES	32
+
+/* The Maple r5 flash is 128K, the loader has the first 20K */
+#define MAPLE_APP_BASE	0x08005000
+#define MAPLE_APP_SIZE	(108 * 1024)
+
+/* Of the 20K of RAM, the loader keeps the first 3K */
+#define MAPLE_RAM_BASE	0x20000C00
+#define MAPLE_RAM_SIZE	(17 * 1024)
+
+/* All of SRAM on the F103RB */
+#define STM32_SRAM	0x20000000
+#define STM32_SRAM_SIZE	(20 * 1024)
+
+/* The STM32 ROM loader owns none of the flash.  The F103 has no
+ * USB loader in ROM, the parts that show up as 0483:df11 are the
+ * F105/F107 (256K, 2K pages, 64K SRAM) and the F2/F4 (16K to 128K
+ * sectors).  The numbers here are for the F105/F107, but the loader
+ * gives the real flash layout in its alt setting name, and that is
+ * what we erase and size by (see dfuse.c).  F2/F4 boards want
+ * sramsize set in the config file.
+ */
+#define STM32_VENDOR	0x0483
+#define STM32_PROD_DFU	0xdf11
+#define STM32_BASE	0x08000000
+#define STM32_SIZE	(256 * 1024)
+#define STM32_PAGE	2048
+#define STM32_XFER	2048
+#define STM32_ROM_SRAM_SIZE	(64 * 1024)
+
+/* A full flash takes a few seconds, this is lots */
+#define JOB_BUDGET	30000	/* ms */
+
+static struct maple_profile builtin[] = {
+    {	"Maple loader", MAPLE_VENDOR, MAPLE_PROD_LOADER, PROFILE_ANY, MAPLE_LOADER,
+	MAPLE_XFER_SIZE, 1, MAPLE_APP_BASE, MAPLE_APP_SIZE,
+	-1, 1000, 5000, 10, 100, 1000,
+	0, MAPLE_RAM_BASE, MAPLE_RAM_SIZE, PROTO_DFU, 1024,
+	STM32_SRAM, STM32_SRAM_SIZE, JOB_BUDGET },
+    {	"Maple serial", MAPLE_VENDOR, MAPLE_PROD_SERIAL, PROFILE_ANY, MAPLE_SERIAL,
+	MAPLE_XFER_SIZE, 1, MAPLE_APP_BASE, MAPLE_APP_SIZE,
+	-1, 1000, 5000, 10, 100, 1000,
+	0, MAPLE_RAM_BASE, MAPLE_RAM_SIZE, PROTO_DFU, 1024,
+	STM32_SRAM, STM32_SRAM_SIZE, JOB_BUDGET },
+    {	"STM32 ROM loader", STM32_VENDOR, STM32_PROD_DFU, PROFILE_ANY, MAPLE_LOADER,
+	STM32_XFER, 0, STM32_BASE, STM32_SIZE,
+	-1, 1000, 5000, 10, 100, 1000,
+	-1, 0, 0, PROTO_DFUSE, STM32_PAGE,
+	STM32_SRAM, STM32_ROM_SRAM_SIZE, JOB_BUDGET },
+};
+
+#define NBUILTIN	(sizeof(builtin) / sizeof(builtin[0]))
+
+/* Config file entries, searched before the built in ones */
+static struct maple_profile profiles[MAX_PROFILES];
+static int nprofiles;
+
+static struct maple_profile *
+profile_search ( struct maple_profile *tab, int n, int vid, int pid, int bcd )
+{
+	struct maple_profile *any = NULL;
+	int i;
+
+	for ( i=0; i<n; i++ ) {
+	    if ( tab[i].vendor != vid || tab[i].product != pid )
+		continue;
+	    if ( tab[i].bcd == bcd )
+		return &tab[i];
+	    if ( tab[i].bcd == PROFILE_ANY && ! any )
+		any = &tab[i];
+	}
+	return any;
+}
+
+/* Find the profile for a device, NULL if we don't know it.
+ * An exact bcdDevice match beats a wildcard, and the config
+ * file beats the built in table.
+ */
+struct maple_profile *
+profile_find ( int vid, int pid, int bcd )
+{
+	struct maple_profile *pp;
+
+	pp = profile_search ( profiles, nprofiles, vid, pid, bcd );
+	if ( pp && pp->bcd == bcd )
+	    return pp;
+	if ( ! pp )
+	    pp = profile_search ( builtin, NBUILTIN, vid, pid, bcd );
+	return pp;
+}
+
+/* For when we know nothing about the device,
+ * like the serial side before we find it, or a simulation.
+ */
+struct maple_profile *
+profile_default ( int kind )
+{
+	if ( kind == MAPLE_SERIAL )
+	    return &builtin[1];
+	return &builtin[0];
+}
+
+/* What is this device to us?  One of the find_maple() codes.
+ */
+int
+profile_kind ( struct libusb_device_descriptor *desc )
+{
+	struct maple_profile *pp;
+
+	pp = profile_find ( desc->idVendor, desc->idProduct, desc->bcdDevice );
+	if ( pp )
+	    return pp->kind;
+	if ( desc->idVendor == MAPLE_VENDOR )
+	    return MAPLE_UNKNOWN;
+	return MAPLE_NONE;
+}
+
+#define NUM_MAX		0x7fffffff
+
+/* A whole number, all of val, in lo to hi */
+static int
+profile_num ( char *val, long lo, long hi, int *np )
+{
+	char *end;
+	long n;
+
+	n = strtol ( val, &end, 0 );
+	if ( end == val || *end || n < lo || n > hi )
+	    return 1;
+	*np = n;
+	return 0;
+}
+
+/* An address, all of val */
+static int
+profile_addr ( char *val, unsigned int *ap )
+{
+	unsigned long a;
+	char *end;
+
+	if ( *val == '-' )
+	    return 1;
+	a = strtoul ( val, &end, 0 );
+	if ( end == val || *end || a > 0xffffffffUL )
+	    return 1;
+	*ap = a;
+	return 0;
+}
+
+/* Returns 0 if the key and value made sense.
+ * Transfers can't be empty (the download would never end),
+ * and nothing else can be negative, bar poll and ramalt.
+ */
+static int
+profile_set ( struct maple_profile *pp, char *key, char *val )
+{
+	if ( strcmp ( key, "name" ) == 0 ) {
+	    snprintf ( pp->name, sizeof(pp->name), "%s", val );
+	    return 0;
+	}
+	if ( strcmp ( key, "kind" ) == 0 ) {
+	    if ( strcmp ( val, "loader" ) == 0 )
+		pp->kind = MAPLE_LOADER;
+	    else if ( strcmp ( val, "serial" ) == 0 )
+		pp->kind = MAPLE_SERIAL;
+	    else
+		return 1;
+	    return 0;
+	}
+	if ( strcmp ( key, "proto" ) == 0 ) {
+	    if ( strcmp ( val, "dfu" ) == 0 )
+		pp->proto = PROTO_DFU;
+	    else if ( strcmp ( val, "dfuse" ) == 0 )
+		pp->proto = PROTO_DFUSE;
+	    else
+		return 1;
+	    return 0;
+	}
+
+	if ( strcmp ( key, "xfer" ) == 0 )
+	    return profile_num ( val, 1, 4096, &pp->xfer_size );
+	if ( strcmp ( key, "alt" ) == 0 )
+	    return profile_num ( val, 0, 255, &pp->alt );
+	if ( strcmp ( key, "base" ) == 0 )
+	    return profile_addr ( val, &pp->flash_base );
+	if ( strcmp ( key, "size" ) == 0 )
+	    return profile_num ( val, 0, NUM_MAX, &pp->flash_size );
+	if ( strcmp ( key, "poll" ) == 0 )
+	    return profile_num ( val, -1, NUM_MAX, &pp->poll_timeout );
+	if ( strcmp ( key, "detach" ) == 0 )
+	    return profile_num ( val, 0, 65535, &pp->detach_timeout );
+	if ( strcmp ( key, "timeout" ) == 0 )
+	    return profile_num ( val, 0, NUM_MAX, &pp->dfu_timeout );
+	if ( strcmp ( key, "trigger" ) == 0 )
+	    return profile_num ( val, 0, NUM_MAX, &pp->trigger_delay );
+	if ( strcmp ( key, "settle" ) == 0 )
+	    return profile_num ( val, 0, NUM_MAX, &pp->trigger_settle );
+	if ( strcmp ( key, "wait" ) == 0 )
+	    return profile_num ( val, 0, NUM_MAX, &pp->loader_wait );
+	if ( strcmp ( key, "ramalt" ) == 0 )
+	    return profile_num ( val, -1, 255, &pp->ram_alt );
+	if ( strcmp ( key, "rambase" ) == 0 )
+	    return profile_addr ( val, &pp->ram_base );
+	if ( strcmp ( key, "ramsize" ) == 0 )
+	    return profile_num ( val, 0, NUM_MAX, &pp->ram_size );
+	if ( strcmp ( key, "page" ) == 0 )
+	    return profile_num ( val, 1, NUM_MAX, &pp->page_size );
+	if ( strcmp ( key, "sram" ) == 0 )
+	    return profile_addr ( val, &pp->sram_base );
+	if ( strcmp ( key, "sramsize" ) == 0 )
+	    return profile_num ( val, 0, NUM_MAX, &pp->sram_size );
+	if ( strcmp ( key, "budget" ) == 0 )
+	    return profile_num ( val, 0, NUM_MAX, &pp->job_budget );
+	return 1;
+}
+
+static int
+profile_line ( char *line )
+{
+	struct maple_profile *pp;
+	struct maple_profile *base;
+	unsigned int vid, pid;
+	char bcd[8];
+	char *tok;
+	char *val;
+
+	tok = strtok ( line, " \t\n" );
+	if ( ! tok || *tok == '#' )
+	    return 0;
+
+	if ( sscanf ( tok, "%x:%x:%7s", &vid, &pid, bcd ) != 3 )
+	    return 1;
+
+	if ( nprofiles == MAX_PROFILES ) {
+	    printf ( "Too many device profiles, %d is the limit\n", MAX_PROFILES );
+	    return 1;
+	}
+	pp = &profiles[nprofiles];
+
+	base = profile_search ( builtin, NBUILTIN, vid, pid, PROFILE_ANY );
+	if ( base )
+	    *pp = *base;
+	else {
+	    *pp = builtin[0];
+	    snprintf ( pp->name, sizeof(pp->name), "%04x:%04x", vid, pid );
+	}
+	pp->vendor = vid;
+	pp->product = pid;
+	pp->bcd = bcd[0] == '*' ? PROFILE_ANY : (int) strtol ( bcd, NULL, 16 );
+
+	while ( (tok = strtok ( NULL, " \t\n" )) ) {
+	    val = strchr ( tok, '=' );
+	    if ( ! val )
+		return 1;
+	    *val++ = '\0';
+	    if ( profile_set ( pp, tok, val ) ) {
+		printf ( "Bad profile setting: %s=%s\n", tok, val );
+		return 1;
+	    }
+	}
+
+	nprofiles++;
+	return 0;
+}
+
+/* Load profiles from a file.  If the file was named
+ * explicitly, it had better be there.
+ */
+int
+profile_load ( char *path, int must )
+{
+	char line[256];
+	FILE *fp;
+	int lineno = 0;
+	int rv = 0;
+
+	fp = fopen ( path, "r" );
+	if ( ! fp ) {
+	    if ( must )
+		printf ( "Cannot open profile file: %s\n", path );
+	    return must;
+	}
+
+	while ( fgets ( line, sizeof(line), fp ) ) {
+	    lineno++;
+	    if ( profile_line ( line ) ) {
+		printf ( "Bad profile at line %d of %s\n", lineno, path );
+		rv = 1;
+		break;
+	    }
+	}
+
+	fclose ( fp );
+	return rv;
+}
+
+/* THE END */
@@ -0,0 +1,316 @@
+/* session.c - maple-util
+ *
+ * Session mode.  Get the board into the loader once, claim
+ * the interface once, run a batch of operations over that
+ * one handle, and only reset the board at the very end.
+ * The reset and re-enumeration is seconds per board, and
+ * this way we pay it once for the whole batch.
+ *
+ * The script is one command per line, # starts a comment:
+ *
+ *   status		- show DFU state and status
+ *   clear		- DFU_CLRSTATUS, to get out of dfuERROR
+ *   abort		- DFU_ABORT, back to dfuIDLE
+ *   download file	- send file to flash
+ *   upload file [n]	- read n bytes of flash (or all of it) into file
+ *   verify file	- read back and compare against file
+ *
+ * The first error ends the session (but the board still gets reset).
+ *
+ * Note that the Maple loader goes to dfuMANIFEST-WAIT-RESET
+ * after a download, and won't do anything more until it gets
+ * the reset, so a download is best left to the end of a script.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <libusb.h>
+
+#include "maple.h"
+#include "dfu.h"
+#include "hash.h"
+
+extern int verbose;
+extern int image_checks;
+
+static int
+session_status ( struct maple_device *mp )
+{
+	struct dfu_status dst;
+
+	if ( dfu_get_status ( mp, &dst ) < 0 ) {
+	    printf ( "Cannot get DFU status\n" );
+	    return 1;
+	}
+	printf ( "state(%u) = %s, status(%u) = %s\n",
+	    dst.bState, dfu_state_to_string ( dst.bState ),
+	    dst.bStatus, dfu_status_to_string ( dst.bStatus ) );
+	return 0;
+}
+
+/* Get the device back to dfuIDLE before starting a transfer,
+ * if something before us left it elsewhere.
+ */
+static int
+session_idle ( struct maple_device *mp )
+{
+	struct dfu_status dst;
+
+	if ( dfu_get_status ( mp, &dst ) < 0 ) {
+	    printf ( "Cannot get DFU status\n" );
+	    return 1;
+	}
+	if ( dst.bState == DFU_STATE_dfuIDLE )
+	    return 0;
+
+	status_retry ( mp );
+
+	if ( dst.bState == DFU_STATE_dfuERROR ) {
+	    if ( dfu_clear_status ( mp->devh, mp->interface ) < 0 ) {
+		printf ( "Cannot clear error status\n" );
+		return 1;
+	    }
+	    return 0;
+	}
+
+	return dfu_abort_to_idle ( mp ) < 0;
+}
+
+static int
+session_download ( struct maple_device *mp, char *name )
+{
+	struct dfu_file file;
+	int n;
+
+	file.name = name;
+	if ( get_file ( &file ) ) {
+	    printf ( "Cannot open file: %s\n", name );
+	    return 1;
+	}
+	if ( image_checks && image_check ( &file, mp->prof ) ) {
+	    put_file ( &file );
+	    return 1;
+	}
+	if ( session_idle ( mp ) ) {
+	    put_file ( &file );
+	    return 1;
+	}
+
+	/* The same checks and hooks (room, suffix, DfuSe, -P) as any flash */
+	n = board_download ( mp, &file );
+	put_file ( &file );
+	return n != file.size;
+}
+
+/* Read flash into a malloc'd buffer, NULL on failure.
+ */
+static unsigned char *
+session_read ( struct maple_device *mp, int want, int *count )
+{
+	unsigned char *buf;
+	int n;
+
+	if ( session_idle ( mp ) )
+	    return NULL;
+
+	buf = malloc ( want );
+	if ( ! buf ) {
+	    printf ( "Cannot allocate upload buffer\n" );
+	    return NULL;
+	}
+
+	n = dfuload_do_upload_buf ( mp, buf, want );
+	if ( n < 0 ) {
+	    free ( buf );
+	    return NULL;
+	}
+
+	/* Stopped on a full buffer, device is still in dfuUPLOAD-IDLE */
+	if ( n == want )
+	    dfu_abort_to_idle ( mp );
+
+	*count = n;
+	return buf;
+}
+
+/* This one streams straight to disk (see dfuload_do_upload) */
+static int
+session_upload ( struct maple_device *mp, char *name, int want )
+{
+	struct dfu_dump dump;
+	int n;
+	int fd;
+
+	if ( want < 0 || want > mp->prof->flash_size )
+	    want = mp->prof->flash_size;
+
+	if ( session_idle ( mp ) )
+	    return 1;
+
+	fd = open ( name, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+	if ( fd < 0 ) {
+	    printf ( "Cannot create file: %s\n", name );
+	    return 1;
+	}
+
+	memset ( &dump, 0, sizeof(dump) );
+	n = dfuload_do_upload ( mp, want, fd, &dump );
+	close ( fd );
+	if ( n < 0 )
+	    return 1;
+
+	/* Stopped short of the end, device is still in dfuUPLOAD-IDLE */
+	if ( want && n == want )
+	    dfu_abort_to_idle ( mp );
+
+	printf ( "%d bytes read to %s\n", n, name );
+	if ( verbose )
+	    dump_report ( &dump );
+	return 0;
+}
+
+static int
+session_verify ( struct maple_device *mp, char *name )
+{
+	struct dfu_file file;
+	unsigned char *buf;
+	int n;
+	int i;
+	int rv = 0;
+
+	file.name = name;
+	if ( get_file ( &file ) ) {
+	    printf ( "Cannot open file: %s\n", name );
+	    return 1;
+	}
+	if ( file_wait ( &file ) ) {
+	    put_file ( &file );
+	    return 1;
+	}
+
+	buf = session_read ( mp, file.size, &n );
+	if ( ! buf ) {
+	    put_file ( &file );
+	    return 1;
+	}
+
+	if ( n != file.size ) {
+	    printf ( "Verify: device gave %d bytes, %s has %d\n", n, name, file.size );
+	    rv = 1;
+	} else if ( hash_buf ( buf, n ) != file.digest ) {
+	    for ( i=0; buf[i] == (unsigned char) file.buf[i]; i++ )
+		;
+	    printf ( "Verify: %s differs at offset 0x%x\n", name, i );
+	    rv = 1;
+	} else
+	    printf ( "Verify: %s matches (%d bytes)\n", name, n );
+
+	free ( buf );
+	put_file ( &file );
+	return rv;
+}
+
+static int
+session_line ( struct maple_device *mp, char *line )
+{
+	char cmd[32];
+	char arg[256];
+	int num = 0;
+	int n;
+
+	n = sscanf ( line, "%31s %255s %i", cmd, arg, &num );
+	if ( n < 1 || cmd[0] == '#' )
+	    return 0;
+
+	if ( verbose )
+	    printf ( "Session: %s", line );
+
+	if ( strcmp ( cmd, "status" ) == 0 )
+	    return session_status ( mp );
+
+	if ( strcmp ( cmd, "clear" ) == 0 )
+	    return dfu_clear_status ( mp->devh, mp->interface ) < 0;
+
+	if ( strcmp ( cmd, "abort" ) == 0 )
+	    return dfu_abort_to_idle ( mp ) < 0;
+
+	if ( n < 2 ) {
+	    printf ( "Session: %s needs a file name\n", cmd );
+	    return 1;
+	}
+
+	if ( strcmp ( cmd, "download" ) == 0 )
+	    return session_download ( mp, arg );
+
+	if ( strcmp ( cmd, "upload" ) == 0 )
+	    return session_upload ( mp, arg, num );
+
+	if ( strcmp ( cmd, "verify" ) == 0 )
+	    return session_verify ( mp, arg );
+
+	printf ( "Session: unknown command: %s\n", cmd );
+	return 1;
+}
+
+int
+session_run ( struct maple_device *mp, char *script )
+{
+	char line[300];
+	FILE *fp;
+	int lineno = 0;
+	int rv = 0;
+
+	if ( strcmp ( script, "-" ) == 0 )
+	    fp = stdin;
+	else
+	    fp = fopen ( script, "r" );
+	if ( ! fp ) {
+	    printf ( "Cannot open session script: %s\n", script );
+	    return 1;
+	}
+
+	while ( fgets ( line, sizeof(line), fp ) ) {
+	    lineno++;
+	    if ( session_line ( mp, line ) ) {
+		printf ( "Session stopped at line %d of %s\n", lineno, script );
+		rv = 1;
+		break;
+	    }
+	}
+
+	if ( fp != stdin )
+	    fclose ( fp );
+	return rv;
+}
+
+/* Get the board into the loader, run the script,
+ * then reset once at the end.
+ */
+int
+session_board ( libusb_context *context, int m, char *script )
+{
+	struct maple_device maple_device;
+	int rv;
+
+	if ( board_to_loader ( context, m, &maple_device ) )
+	    return 1;
+
+	if ( maple_open ( &maple_device ) ) {
+	    maple_close ( &maple_device );
+	    libusb_unref_device ( maple_device.dev );
+	    return 1;
+	}
+
+	rv = session_run ( &maple_device, script );
+
+	perform_reset ( &maple_device );
+	maple_close ( &maple_device );
+	libusb_unref_device ( maple_device.dev );
+	return rv;
+}
+
+/* THE END */
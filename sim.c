@@ -0,0 +1,381 @@
+/* sim.c - maple-util
+ *
+ * A simulated Maple loader, so the download code (and things
+ * like the RAM load mode) can be exercised without a board.
+ * It plugs in underneath dfu.c just like trace replay does.
+ *
+ * This follows what the real loader does, as far as we know it:
+ * alt 1 writes to flash at 0x08005000, alt 0 writes to RAM
+ * at 0x20000C00.  Data is taken in order regardless of wValue.
+ * GETSTATUS after a flash block says dfuDNBUSY with a
+ * bwPollTimeout covering the flash programming, then dfuDNLOAD-IDLE.
+ * After the zero length DNLOAD it goes straight to
+ * dfuMANIFEST-WAIT-RESET, since it is not manifestation tolerant.
+ * Its DFU attributes are 0x03 (download and upload), other
+ * loaders can be had with attr=.
+ *
+ * The spec given to sim_open() is "maple", or a comma separated list of:
+ *
+ *   noram	- no alt setting 0 at all
+ *   ramfail	- alt 0 is there, but downloads to it fail (errTARGET)
+ *   usb=N	- us each control transfer takes (default 1000, under 1000000)
+ *   flash=N	- ms to program each 1K of flash (default 25)
+ *   attr=N	- bmAttributes of the DFU functional descriptor,
+ *		  -1 for none.  Manifestation tolerant (4) goes through
+ *		  dfuMANIFEST for flash=N ms and back to dfuIDLE,
+ *		  will detach (8) starts over on DETACH by itself.
+ *
+ * and to see how the code above copes when things go wrong,
+ * faults, each so many per 1000 control transfers:
+ *
+ *   stall=N	- the request is STALLed (dfuERROR, errSTALLEDPKT)
+ *   timeout=N	- the request is lost, LIBUSB_ERROR_TIMEOUT
+ *   error=N	- a download block fails, dfuERROR at the next
+ *		  GETSTATUS, going through every status code in turn
+ *   vanish=N	- the device drops off the bus, nothing works
+ *		  (LIBUSB_ERROR_NO_DEVICE) until it is reset
+ *   hang=N	- the device wedges, every request sits out its
+ *		  deadline and times out, until it is reset
+ *   seed=N	- start the fault dice here, so a run can be repeated
+ *
+ * DETACH never faults, so a reset always gets the board back.
+ * A timeout comes back at once, we don't wait it out.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <libusb.h>
+
+#include "maple.h"
+#include "dfu.h"
+
+#define SIM_FLASH_SIZE	(108 * 1024)
+#define SIM_RAM_SIZE	(17 * 1024)
+
+struct sim_dev {
+	int state;
+	int status;
+	int alt;
+	int offset;		/* where the next block goes */
+	int busy_ms;		/* what the next GETSTATUS will say */
+	int no_ram;
+	int ram_fail;
+	int usb_us;
+	int flash_ms;
+	int attr;
+	int fault_rate[SIM_NFAULT];	/* per 1000 transfers */
+	unsigned int seed;
+	int next_error;		/* status code the next error fault gives */
+	int gone;
+	int hung;
+	unsigned char flash[SIM_FLASH_SIZE];
+	unsigned char ram[SIM_RAM_SIZE];
+};
+
+int sim_active = 0;
+int sim_faults[SIM_NFAULT];
+
+static struct sim_dev sim;
+
+static unsigned char *
+sim_mem ( int *size )
+{
+	if ( sim.alt == 0 ) {
+	    *size = SIM_RAM_SIZE;
+	    return sim.ram;
+	}
+	*size = SIM_FLASH_SIZE;
+	return sim.flash;
+}
+
+static int
+sim_error ( int status )
+{
+	sim.state = DFU_STATE_dfuERROR;
+	sim.status = status;
+	return LIBUSB_ERROR_PIPE;
+}
+
+/* Roll the dice for one kind of fault */
+static int
+sim_fault ( int kind )
+{
+	if ( ! sim.fault_rate[kind] )
+	    return 0;
+	if ( rand_r ( &sim.seed ) % 1000 >= sim.fault_rate[kind] )
+	    return 0;
+	sim_faults[kind]++;
+	return 1;
+}
+
+static int
+sim_dnload ( struct dfu_xfer *xp )
+{
+	unsigned char *mem;
+	int size;
+
+	if ( sim.state != DFU_STATE_dfuIDLE && sim.state != DFU_STATE_dfuDNLOAD_IDLE )
+	    return sim_error ( DFU_STATUS_errSTALLEDPKT );
+
+	if ( xp->wLength == 0 ) {
+	    if ( sim.state == DFU_STATE_dfuIDLE )
+		return sim_error ( DFU_STATUS_errNOTDONE );
+	    sim.state = DFU_STATE_dfuMANIFEST_SYNC;
+	    return 0;
+	}
+
+	if ( sim.state == DFU_STATE_dfuIDLE )
+	    sim.offset = 0;
+
+	/* Take the data, complain at GETSTATUS */
+	mem = sim_mem ( &size );
+	sim.state = DFU_STATE_dfuDNLOAD_SYNC;
+	if ( sim_fault ( SIM_ERROR ) ) {
+	    sim.status = sim.next_error;
+	    sim.next_error = sim.next_error % DFU_STATUS_errSTALLEDPKT + 1;
+	} else if ( sim.alt == 0 && sim.ram_fail )
+	    sim.status = DFU_STATUS_errTARGET;
+	else if ( sim.offset + xp->wLength > size )
+	    sim.status = DFU_STATUS_errADDRESS;
+	else {
+	    memcpy ( mem + sim.offset, xp->data, xp->wLength );
+	    sim.offset += xp->wLength;
+	}
+
+	/* RAM takes no time to write */
+	sim.busy_ms = 0;
+	if ( sim.alt != 0 )
+	    sim.busy_ms = (sim.flash_ms * xp->wLength + 1023) / 1024;
+
+	return xp->wLength;
+}
+
+static int
+sim_upload ( struct dfu_xfer *xp )
+{
+	unsigned char *mem;
+	int size;
+	int n;
+
+	if ( sim.state != DFU_STATE_dfuIDLE && sim.state != DFU_STATE_dfuUPLOAD_IDLE )
+	    return sim_error ( DFU_STATUS_errSTALLEDPKT );
+
+	if ( sim.state == DFU_STATE_dfuIDLE )
+	    sim.offset = 0;
+
+	mem = sim_mem ( &size );
+	n = size - sim.offset;
+	if ( n > xp->wLength )
+	    n = xp->wLength;
+	memcpy ( xp->data, mem + sim.offset, n );
+	sim.offset += n;
+
+	/* A short block ends the upload */
+	if ( n < xp->wLength )
+	    sim.state = DFU_STATE_dfuIDLE;
+	else
+	    sim.state = DFU_STATE_dfuUPLOAD_IDLE;
+	return n;
+}
+
+static int
+sim_getstatus ( struct dfu_xfer *xp )
+{
+	int poll = 0;
+	int reply;
+
+	if ( sim.status != DFU_STATUS_OK )
+	    sim.state = DFU_STATE_dfuERROR;
+
+	switch ( sim.state ) {
+	    case DFU_STATE_dfuDNLOAD_SYNC:
+		if ( sim.busy_ms ) {
+		    reply = DFU_STATE_dfuDNBUSY;
+		    poll = sim.busy_ms;
+		} else
+		    reply = DFU_STATE_dfuDNLOAD_IDLE;
+		sim.state = DFU_STATE_dfuDNLOAD_IDLE;
+		break;
+	    case DFU_STATE_dfuMANIFEST_SYNC:
+		if ( sim.attr >= 0 && (sim.attr & USB_DFU_MANIFEST_TOL) ) {
+		    reply = DFU_STATE_dfuMANIFEST;
+		    poll = sim.flash_ms;
+		} else
+		    reply = DFU_STATE_dfuMANIFEST_WAIT_RST;
+		sim.state = reply;
+		break;
+	    case DFU_STATE_dfuMANIFEST:
+		reply = DFU_STATE_dfuIDLE;
+		sim.state = reply;
+		break;
+	    default:
+		reply = sim.state;
+		break;
+	}
+
+	if ( xp->wLength < 6 )
+	    return LIBUSB_ERROR_OVERFLOW;
+	xp->data[0] = sim.status;
+	xp->data[1] = poll & 0xff;
+	xp->data[2] = (poll >> 8) & 0xff;
+	xp->data[3] = (poll >> 16) & 0xff;
+	xp->data[4] = reply;
+	xp->data[5] = 0;
+	return 6;
+}
+
+static int
+sim_xfer ( libusb_device_handle *devh, struct dfu_xfer *xp )
+{
+	struct timespec delay;
+
+	delay.tv_sec = 0;
+	delay.tv_nsec = sim.usb_us * 1000L;
+	nanosleep ( &delay, NULL );
+
+	if ( sim.gone )
+	    return LIBUSB_ERROR_NO_DEVICE;
+	if ( xp->bRequest != DFU_DETACH ) {
+	    if ( sim.hung || sim_fault ( SIM_HANG ) ) {
+		sim.hung = 1;
+		milli_sleep ( xp->timeout );
+		return LIBUSB_ERROR_TIMEOUT;
+	    }
+	    if ( sim_fault ( SIM_VANISH ) ) {
+		sim.gone = 1;
+		return LIBUSB_ERROR_NO_DEVICE;
+	    }
+	    if ( sim_fault ( SIM_TIMEOUT ) )
+		return LIBUSB_ERROR_TIMEOUT;
+	    if ( sim_fault ( SIM_STALL ) )
+		return sim_error ( DFU_STATUS_errSTALLEDPKT );
+	}
+
+	/* No talking while waiting for reset */
+	if ( sim.state == DFU_STATE_dfuMANIFEST_WAIT_RST && xp->bRequest != DFU_DETACH )
+	    return LIBUSB_ERROR_PIPE;
+
+	switch ( xp->bRequest ) {
+	    case DFU_DETACH:
+		if ( sim.attr >= 0 && (sim.attr & USB_DFU_WILL_DETACH) )
+		    sim_reset ();
+		return 0;
+	    case DFU_DNLOAD:
+		return sim_dnload ( xp );
+	    case DFU_UPLOAD:
+		return sim_upload ( xp );
+	    case DFU_GETSTATUS:
+		return sim_getstatus ( xp );
+	    case DFU_CLRSTATUS:
+		if ( sim.state == DFU_STATE_dfuERROR ) {
+		    sim.state = DFU_STATE_dfuIDLE;
+		    sim.status = DFU_STATUS_OK;
+		}
+		return 0;
+	    case DFU_GETSTATE:
+		if ( xp->wLength < 1 )
+		    return LIBUSB_ERROR_OVERFLOW;
+		xp->data[0] = sim.state;
+		return 1;
+	    case DFU_ABORT:
+		if ( sim.state == DFU_STATE_dfuERROR )
+		    return sim_error ( DFU_STATUS_errSTALLEDPKT );
+		sim.state = DFU_STATE_dfuIDLE;
+		return 0;
+	}
+	return sim_error ( DFU_STATUS_errSTALLEDPKT );
+}
+
+/* Like libusb_set_interface_alt_setting(), this is where
+ * a loader with no RAM target lets you know.
+ */
+int
+sim_set_alt ( int alt )
+{
+	if ( sim.gone )
+	    return LIBUSB_ERROR_NO_DEVICE;
+	if ( alt < 0 || alt > 1 || (alt == 0 && sim.no_ram) )
+	    return LIBUSB_ERROR_NOT_FOUND;
+	sim.alt = alt;
+	return 0;
+}
+
+/* Power up (or reset) the simulated board, waiting in the loader */
+void
+sim_reset ( void )
+{
+	sim.state = DFU_STATE_dfuIDLE;
+	sim.status = DFU_STATUS_OK;
+	sim.offset = 0;
+	sim.busy_ms = 0;
+	sim.alt = 1;
+	sim.gone = 0;
+	sim.hung = 0;
+}
+
+/* What the functional descriptor would say, for perform_reset() */
+int
+sim_dfu_attr ( void )
+{
+	return sim.attr;
+}
+
+int
+sim_open ( char *spec )
+{
+	char buf[256];
+	char *tok;
+
+	memset ( &sim, 0, sizeof(sim) );
+	memset ( sim.flash, 0xff, sizeof(sim.flash) );
+	sim.usb_us = 1000;
+	sim.flash_ms = 25;
+	sim.attr = USB_DFU_CAN_DOWNLOAD | USB_DFU_CAN_UPLOAD;
+	sim.seed = 1;
+	sim.next_error = DFU_STATUS_errTARGET;
+
+	snprintf ( buf, sizeof(buf), "%s", spec );
+	for ( tok = strtok ( buf, "," ); tok; tok = strtok ( NULL, "," ) ) {
+	    if ( strcmp ( tok, "noram" ) == 0 )
+		sim.no_ram = 1;
+	    else if ( strcmp ( tok, "ramfail" ) == 0 )
+		sim.ram_fail = 1;
+	    else if ( strncmp ( tok, "usb=", 4 ) == 0 ) {
+		/* It all goes in tv_nsec, so under a second */
+		sim.usb_us = atoi ( tok + 4 );
+		if ( sim.usb_us < 0 || sim.usb_us > 999999 ) {
+		    printf ( "Simulated USB latency must be 0 to 999999 us: %s\n", tok );
+		    return 1;
+		}
+	    } else if ( strncmp ( tok, "flash=", 6 ) == 0 )
+		sim.flash_ms = atoi ( tok + 6 );
+	    else if ( strncmp ( tok, "attr=", 5 ) == 0 )
+		sim.attr = strtol ( tok + 5, NULL, 0 );
+	    else if ( strncmp ( tok, "stall=", 6 ) == 0 )
+		sim.fault_rate[SIM_STALL] = atoi ( tok + 6 );
+	    else if ( strncmp ( tok, "timeout=", 8 ) == 0 )
+		sim.fault_rate[SIM_TIMEOUT] = atoi ( tok + 8 );
+	    else if ( strncmp ( tok, "error=", 6 ) == 0 )
+		sim.fault_rate[SIM_ERROR] = atoi ( tok + 6 );
+	    else if ( strncmp ( tok, "vanish=", 7 ) == 0 )
+		sim.fault_rate[SIM_VANISH] = atoi ( tok + 7 );
+	    else if ( strncmp ( tok, "hang=", 5 ) == 0 )
+		sim.fault_rate[SIM_HANG] = atoi ( tok + 5 );
+	    else if ( strncmp ( tok, "seed=", 5 ) == 0 )
+		sim.seed = atoi ( tok + 5 );
+	    else if ( strcmp ( tok, "maple" ) != 0 ) {
+		printf ( "Unknown simulation option: %s\n", tok );
+		return 1;
+	    }
+	}
+
+	sim_reset ();
+	sim_active = 1;
+	dfu_xfer_hook = sim_xfer;
+	return 0;
+}
+
+/* THE END */
@@ -0,0 +1,225 @@
+/* soak.c - maple-util
+ *
+ * Soak mode.  With -k N (and -S, see sim.c) we flash the image
+ * N times over, through the same download and reset code a real
+ * board gets, with the simulated loader throwing faults at us.
+ * When a download fails, we recover the board and start the image
+ * over, up to SOAK_TRIES times a cycle:
+ *
+ *   dfuERROR		- CLRSTATUS
+ *   anything else	- ABORT, back to dfuIDLE
+ *   gone, wedged	- reset it (power cycle) and open it again
+ *     or stuck
+ *
+ * At the end we say how it went: throughput, cycle times (p50, p99
+ * and max), how long recovery took, and whether we leaked anything.
+ * For leaks we compare open fds, malloc'd bytes, open device
+ * handles and libusb device lists before and after the run.
+ * The simulated loader itself takes no device lists, so those
+ * only show up if a reset or reopen goes looking for the board.
+ *
+ *   maple-util -S maple,usb=0,flash=0,stall=5,error=5,vanish=2 -k 5000 image.bin
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <malloc.h>
+
+#include <libusb.h>
+
+#include "maple.h"
+#include "dfu.h"
+
+#define SOAK_TRIES	5	/* downloads per cycle */
+#define SOAK_KICKS	3	/* clear or abort, before we reset */
+
+extern int show_progress;
+extern int maple_handles;
+extern int maple_lists;
+
+static int
+ull_compare ( const void *a, const void *b )
+{
+	unsigned long long x = *(const unsigned long long *) a;
+	unsigned long long y = *(const unsigned long long *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* pct of n sorted values, in ms */
+static double
+soak_pct ( unsigned long long *val, int n, int pct )
+{
+	int i;
+
+	if ( n == 0 )
+	    return 0.0;
+	i = (n * pct + 99) / 100 - 1;
+	if ( i < 0 )
+	    i = 0;
+	return val[i] / 1.0e6;
+}
+
+static int
+soak_fds ( void )
+{
+	DIR *dp;
+	int n = 0;
+
+	dp = opendir ( "/proc/self/fd" );
+	if ( ! dp )
+	    return -1;
+	while ( readdir ( dp ) )
+	    n++;
+	closedir ( dp );
+	return n;
+}
+
+/* Get the board back to dfuIDLE, returns 0 if we did.
+ */
+static int
+soak_recover ( struct maple_device *mp )
+{
+	struct dfu_status dst;
+	int ntimeout = 0;
+	int s;
+	int i;
+
+	status_retry ( mp );
+
+	for ( i=0; i<SOAK_KICKS; i++ ) {
+	    s = dfu_get_status ( mp, &dst );
+	    if ( s == LIBUSB_ERROR_NO_DEVICE )
+		break;
+	    /* One can be a lost request, two is a wedged board */
+	    if ( s == LIBUSB_ERROR_TIMEOUT && ++ntimeout == 2 )
+		break;
+	    if ( s != 6 )
+		continue;
+	    if ( dst.bState == DFU_STATE_dfuIDLE )
+		return 0;
+	    if ( dst.bState == DFU_STATE_dfuERROR )
+		dfu_clear_status ( mp->devh, mp->interface );
+	    else
+		dfu_abort ( mp->devh, mp->interface );
+	}
+
+	/* Gone, or won't listen, the big hammer */
+	perform_reset ( mp );
+	maple_close ( mp );
+	return maple_open ( mp );
+}
+
+static void
+soak_report ( char *what, unsigned long long *val, int n )
+{
+	qsort ( val, n, sizeof(*val), ull_compare );
+	printf ( "  %-16s %7d  p50 %8.3f  p99 %8.3f  max %8.3f ms\n", what, n,
+	    soak_pct ( val, n, 50 ), soak_pct ( val, n, 99 ),
+	    n ? val[n-1] / 1.0e6 : 0.0 );
+}
+
+int
+soak_run ( struct dfu_file *fp, int cycles )
+{
+	struct maple_device maple_device;
+	unsigned long long *cycle_t;
+	unsigned long long *recover_t;
+	unsigned long long t_start, t0, t1;
+	unsigned long long bytes = 0;
+	size_t heap0;
+	int fds0, handles0, lists0;
+	int nrecover = 0;
+	int nfail = 0;
+	int ngood = 0;
+	int tries;
+	int s;
+	int c;
+
+	if ( ! sim_active ) {
+	    printf ( "Soak mode needs a simulated loader (-S)\n" );
+	    return 1;
+	}
+
+	/* A compressed image should be done unpacking, or it looks like a leak */
+	if ( file_wait ( fp ) )
+	    return 1;
+
+	fds0 = soak_fds ();
+	heap0 = mallinfo2 ().uordblks;
+	handles0 = maple_handles;
+	lists0 = maple_lists;
+
+	cycle_t = malloc ( cycles * sizeof(*cycle_t) );
+	recover_t = malloc ( cycles * SOAK_TRIES * sizeof(*recover_t) );
+	if ( ! cycle_t || ! recover_t ) {
+	    printf ( "No memory for %d cycles\n", cycles );
+	    return 1;
+	}
+
+	memset ( &maple_device, 0, sizeof(maple_device) );
+	maple_device.desc.idVendor = MAPLE_VENDOR;
+	maple_device.desc.idProduct = MAPLE_PROD_LOADER;
+	timeline_name ( "soak" );
+
+	show_progress = 0;
+	t_start = nano_time ();
+	for ( c=0; c<cycles; c++ ) {
+	    t0 = nano_time ();
+	    if ( maple_open ( &maple_device ) ) {
+		maple_close ( &maple_device );
+		cycle_t[c] = nano_time () - t0;
+		nfail++;
+		continue;
+	    }
+
+	    for ( tries=0; tries<SOAK_TRIES; tries++ ) {
+		s = board_download ( &maple_device, fp );
+		if ( s == fp->size )
+		    break;
+		t1 = nano_time ();
+		if ( soak_recover ( &maple_device ) )
+		    break;
+		recover_t[nrecover++] = nano_time () - t1;
+	    }
+
+	    if ( s == fp->size ) {
+		ngood++;
+		bytes += s;
+	    } else
+		nfail++;
+
+	    perform_reset ( &maple_device );
+	    maple_close ( &maple_device );
+	    cycle_t[c] = nano_time () - t0;
+
+	    if ( (c + 1) % 1000 == 0 )
+		printf ( "Soak: %d cycles, %d failed\n", c + 1, nfail );
+	}
+	t1 = nano_time ();
+	show_progress = 1;
+
+	printf ( "Soak: %d cycles of %s in %.3f seconds, %d good, %d failed\n",
+	    cycles, fp->name, (t1 - t_start) / 1.0e9, ngood, nfail );
+	printf ( "  faults: %d stall, %d timeout, %d dfuERROR, %d vanish, %d hang\n",
+	    sim_faults[SIM_STALL], sim_faults[SIM_TIMEOUT],
+	    sim_faults[SIM_ERROR], sim_faults[SIM_VANISH], sim_faults[SIM_HANG] );
+	printf ( "  throughput: %.1f KB/s, %.1f cycles/s\n",
+	    bytes / 1024.0 / ((t1 - t_start) / 1.0e9), cycles / ((t1 - t_start) / 1.0e9) );
+	soak_report ( "cycle time", cycle_t, cycles );
+	soak_report ( "recovery", recover_t, nrecover );
+
+	free ( cycle_t );
+	free ( recover_t );
+
+	/* The arrays are gone, so the heap should be back where it was */
+	printf ( "  leaks: %d fds, %ld bytes of heap, %d device handles, %d device lists\n",
+	    soak_fds () - fds0, (long) (mallinfo2 ().uordblks - heap0),
+	    maple_handles - handles0, maple_lists - lists0 );
+
+	return nfail != 0;
+}
+
+/* THE END */
@@ -0,0 +1,326 @@
+/* status.c - maple-util
+ *
+ * The status board.  With -m we keep a slot per board in shared
+ * memory, with the DFU state, bytes sent, polls, retries and the
+ * last error, so a monitor (maple-util -M, or a metrics scraper
+ * that maps the region itself) can watch a flashing station
+ * without parsing anything we print.
+ *
+ * Each slot has one writer, the thread working that board, and
+ * is guarded by a sequence count (a seqlock).  The writer makes
+ * the count odd, changes the slot, and makes it even again.
+ * A reader copies the slot and tries again if the count was odd
+ * or changed under it.  Readers never take a lock or write to the
+ * region, so however often they look the writers never wait.
+ *
+ * Slots are claimed by pid, so several maple-util processes can
+ * share the board, and slots left by a process that went away
+ * get used again.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/mman.h>
+
+#include <libusb.h>
+
+#include "maple.h"
+#include "dfu.h"
+
+#define STATUS_NAME	"/maple-util-status"
+#define STATUS_MAGIC	0x4d504c53	/* "MPLS" */
+#define STATUS_SLOTS	64
+#define STATUS_TRIES	1000	/* reads before we call a slot stale */
+
+struct status_slot {
+	unsigned int seq;		/* odd while being written */
+	int pid;			/* owner, 0 if free */
+	char port[32];
+	int state;			/* DFU bState, -1 before we know */
+	int status;			/* DFU bStatus */
+	int total;			/* bytes in this download */
+	int bytes;			/* bytes sent so far */
+	int polls;			/* GETSTATUS requests */
+	int retries;
+	unsigned long long t_start;	/* nano_time() at the start */
+	unsigned long long t_update;	/* nano_time() at the last change */
+	char error[64];
+};
+
+struct status_board {
+	unsigned int magic;
+	int nslots;
+	struct status_slot slot[STATUS_SLOTS];
+};
+
+static struct status_board *board;
+
+int status_active = 0;
+
+static struct status_board *
+status_map ( int flags )
+{
+	struct status_board *bp;
+	int fd;
+
+	fd = shm_open ( STATUS_NAME, flags, 0644 );
+	if ( fd < 0 )
+	    return NULL;
+	if ( (flags & O_CREAT) && ftruncate ( fd, sizeof(*bp) ) < 0 ) {
+	    close ( fd );
+	    return NULL;
+	}
+	bp = mmap ( NULL, sizeof(*bp), (flags & O_RDWR) ? PROT_READ | PROT_WRITE : PROT_READ,
+		MAP_SHARED, fd, 0 );
+	close ( fd );
+	if ( bp == MAP_FAILED )
+	    return NULL;
+	return bp;
+}
+
+/* Set up the region, for -m.
+ * A new region is all zero, which is all slots free.
+ */
+int
+status_init ( void )
+{
+	board = status_map ( O_RDWR | O_CREAT );
+	if ( ! board ) {
+	    printf ( "Cannot set up the status board %s\n", STATUS_NAME );
+	    return 1;
+	}
+	board->nslots = STATUS_SLOTS;
+	board->magic = STATUS_MAGIC;
+	status_active = 1;
+	return 0;
+}
+
+/* Writer side of the seqlock.
+ * The fences keep the slot changes between the two counts.
+ */
+static void
+slot_begin ( struct status_slot *sp )
+{
+	__atomic_store_n ( &sp->seq, sp->seq + 1, __ATOMIC_RELAXED );
+	__atomic_thread_fence ( __ATOMIC_RELEASE );
+}
+
+static void
+slot_end ( struct status_slot *sp )
+{
+	sp->t_update = nano_time ();
+	__atomic_store_n ( &sp->seq, sp->seq + 1, __ATOMIC_RELEASE );
+}
+
+/* Reader side, a consistent copy of the slot.
+ * A writer that died mid update leaves seq odd forever,
+ * so give up after a while and return 1, the copy is
+ * whatever was there (and may be torn).
+ */
+static int
+slot_read ( struct status_slot *sp, struct status_slot *copy )
+{
+	unsigned int s1, s2;
+	int tries;
+
+	for ( tries=0; tries<STATUS_TRIES; tries++ ) {
+	    s1 = __atomic_load_n ( &sp->seq, __ATOMIC_ACQUIRE );
+	    if ( s1 & 1 )
+		continue;
+	    memcpy ( copy, sp, sizeof(*copy) );
+	    __atomic_thread_fence ( __ATOMIC_ACQUIRE );
+	    s2 = __atomic_load_n ( &sp->seq, __ATOMIC_RELAXED );
+	    if ( s1 == s2 )
+		return 0;
+	}
+	memcpy ( copy, sp, sizeof(*copy) );
+	copy->port[sizeof(copy->port)-1] = '\0';
+	copy->error[sizeof(copy->error)-1] = '\0';
+	return 1;
+}
+
+static int
+slot_dead ( int pid )
+{
+	return pid == 0 || (kill ( pid, 0 ) < 0 && errno == ESRCH);
+}
+
+/* Get a slot for a board we just opened.
+ * Our own slot for the same port if we had one,
+ * else the first free one.  No slot is no big deal.
+ */
+void
+status_open ( struct maple_device *mp )
+{
+	struct status_slot *sp;
+	char port[32];
+	int me = getpid ();
+	int pid;
+	int i;
+
+	mp->slot = NULL;
+	if ( ! status_active )
+	    return;
+
+	if ( mp->dev )
+	    maple_port_path ( mp->dev, port );
+	else
+	    strcpy ( port, "simulated" );
+
+	for ( i=0; i<STATUS_SLOTS; i++ ) {
+	    sp = &board->slot[i];
+	    if ( sp->pid == me && strcmp ( sp->port, port ) == 0 ) {
+		mp->slot = sp;
+		break;
+	    }
+	}
+
+	for ( i=0; i<STATUS_SLOTS && ! mp->slot; i++ ) {
+	    sp = &board->slot[i];
+	    pid = sp->pid;
+	    if ( ! slot_dead ( pid ) )
+		continue;
+	    if ( __atomic_compare_exchange_n ( &sp->pid, &pid, me, 0,
+		    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED ) )
+		mp->slot = sp;
+	}
+
+	sp = mp->slot;
+	if ( ! sp )
+	    return;
+
+	/* The last owner may have died in the middle of an update */
+	if ( sp->seq & 1 )
+	    sp->seq++;
+
+	slot_begin ( sp );
+	strcpy ( sp->port, port );
+	sp->state = -1;
+	sp->status = 0;
+	sp->total = 0;
+	sp->bytes = 0;
+	sp->polls = 0;
+	sp->retries = 0;
+	sp->error[0] = '\0';
+	sp->t_start = nano_time ();
+	slot_end ( sp );
+}
+
+/* A download (or upload) of total bytes is starting */
+void
+status_start ( struct maple_device *mp, int total )
+{
+	struct status_slot *sp = mp->slot;
+
+	if ( ! sp )
+	    return;
+	slot_begin ( sp );
+	sp->total = total;
+	sp->bytes = 0;
+	sp->t_start = nano_time ();
+	slot_end ( sp );
+}
+
+void
+status_bytes ( struct maple_device *mp, int bytes )
+{
+	struct status_slot *sp = mp->slot;
+
+	if ( ! sp )
+	    return;
+	slot_begin ( sp );
+	sp->bytes = bytes;
+	slot_end ( sp );
+}
+
+/* From every GETSTATUS that got an answer */
+void
+status_state ( struct maple_device *mp, int state, int status )
+{
+	struct status_slot *sp = mp->slot;
+
+	if ( ! sp )
+	    return;
+	slot_begin ( sp );
+	sp->state = state;
+	sp->status = status;
+	sp->polls++;
+	if ( status )
+	    snprintf ( sp->error, sizeof(sp->error), "%s", dfu_status_to_string ( status ) );
+	slot_end ( sp );
+}
+
+void
+status_error ( struct maple_device *mp, char *msg )
+{
+	struct status_slot *sp = mp->slot;
+
+	if ( ! sp )
+	    return;
+	slot_begin ( sp );
+	snprintf ( sp->error, sizeof(sp->error), "%s", msg );
+	slot_end ( sp );
+}
+
+void
+status_retry ( struct maple_device *mp )
+{
+	struct status_slot *sp = mp->slot;
+
+	mp->retries++;
+	if ( ! sp )
+	    return;
+	slot_begin ( sp );
+	sp->retries++;
+	slot_end ( sp );
+}
+
+/* The reader, for -M.
+ * nano_time() is CLOCK_MONOTONIC, the same for every process,
+ * so we can work out ages and rates from another process.
+ */
+int
+status_show ( void )
+{
+	struct status_board *bp;
+	struct status_slot s;
+	unsigned long long now;
+	const char *state;
+	double secs;
+	int stale;
+	int i;
+
+	bp = status_map ( O_RDONLY );
+	if ( ! bp || bp->magic != STATUS_MAGIC ) {
+	    printf ( "No status board (is anyone running with -m ?)\n" );
+	    return 1;
+	}
+
+	now = nano_time ();
+	printf ( "%-12s %7s %-22s %15s %9s %6s %4s %8s  %s\n",
+	    "port", "pid", "state", "bytes", "KB/s", "polls", "retr", "age", "last error" );
+	for ( i=0; i<bp->nslots && i<STATUS_SLOTS; i++ ) {
+	    stale = slot_read ( &bp->slot[i], &s );
+	    if ( ! s.pid || ! s.port[0] )
+		continue;
+	    state = s.state < 0 ? NULL : dfu_state_to_string ( s.state );
+	    secs = (s.t_update - s.t_start) / 1.0e9;
+	    printf ( "%-12s %7d %-22s %7d/%-7d %9.1f %6d %4d %7.1fs  %s%s\n",
+		s.port, s.pid,
+		state ? state : "-",
+		s.bytes, s.total,
+		secs > 0 ? s.bytes / 1024.0 / secs : 0.0,
+		s.polls, s.retries,
+		(now - s.t_update) / 1.0e9,
+		s.error[0] ? s.error : "-",
+		slot_dead ( s.pid ) ? " (exited)" : stale ? " (stale)" : "" );
+	}
+	munmap ( bp, sizeof(*bp) );
+	return 0;
+}
+
+/* THE END */
@@ -0,0 +1,158 @@
+/* suffix.c - maple-util
+ *
+ * DFU suffix handling (DFU spec 1.1, appendix B).
+ * A .dfu file is the image with 16 bytes tacked on the end:
+ *
+ *   bcdDevice, idProduct, idVendor, bcdDFU	(2 bytes each, LE)
+ *   "UFD"					(reversed)
+ *   bLength					(16)
+ *   dwCRC					(4 bytes, LE)
+ *
+ * The CRC is the usual reflected CRC-32 over everything before
+ * dwCRC, started at ~0 and not inverted at the end (as dfu-util).
+ * 0xffff for any of the ids means "don't care".
+ *
+ * We strip the suffix when we read the file, and keep the ids
+ * to check against the board once we have it open, before any
+ * data goes out.  The CRC is done 8 bytes at a time (slice by 8)
+ * so even a full size image is checked in well under a millisecond.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <libusb.h>
+
+#include "maple.h"
+
+#define SUFFIX_LEN	16
+#define SUFFIX_ANY	0xffff
+
+static uint32_t crc_table[8][256];
+static int crc_ready;
+
+static void
+crc_init ( void )
+{
+	uint32_t c;
+	int i, j;
+
+	for ( i=0; i<256; i++ ) {
+	    c = i;
+	    for ( j=0; j<8; j++ )
+		c = (c & 1) ? (c >> 1) ^ 0xedb88320 : c >> 1;
+	    crc_table[0][i] = c;
+	}
+	for ( i=0; i<256; i++ )
+	    for ( j=1; j<8; j++ )
+		crc_table[j][i] = (crc_table[j-1][i] >> 8) ^ crc_table[0][crc_table[j-1][i] & 0xff];
+	crc_ready = 1;
+}
+
+/* Carry on a CRC over more bytes, for patch.c too */
+uint32_t
+crc32_update ( uint32_t crc, const unsigned char *p, int len )
+{
+	uint32_t lo, hi;
+
+	if ( ! crc_ready )
+	    crc_init ();
+
+	while ( len >= 8 ) {
+	    lo = crc ^ (p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24));
+	    hi = p[4] | (p[5] << 8) | (p[6] << 16) | ((uint32_t) p[7] << 24);
+	    crc = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff] ^
+		  crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24] ^
+		  crc_table[3][hi & 0xff] ^ crc_table[2][(hi >> 8) & 0xff] ^
+		  crc_table[1][(hi >> 16) & 0xff] ^ crc_table[0][hi >> 24];
+	    p += 8;
+	    len -= 8;
+	}
+	while ( len-- )
+	    crc = (crc >> 8) ^ crc_table[0][(crc ^ *p++) & 0xff];
+
+	return crc;
+}
+
+static uint32_t
+crc32_dfu ( const unsigned char *p, int len )
+{
+	return crc32_update ( 0xffffffff, p, len );
+}
+
+static int
+get16 ( unsigned char *p )
+{
+	return p[0] | (p[1] << 8);
+}
+
+/* Look for a suffix on a file we just read, and strip it.
+ * Returns 0 if there was none, or a good one.
+ */
+int
+suffix_read ( struct dfu_file *fp )
+{
+	unsigned char *buf = (unsigned char *) fp->buf;
+	unsigned char *sp;
+	uint32_t crc;
+	int len;
+
+	fp->has_suffix = 0;
+	if ( fp->size < SUFFIX_LEN )
+	    return 0;
+
+	sp = buf + fp->size - SUFFIX_LEN;
+	if ( sp[8] != 'U' || sp[9] != 'F' || sp[10] != 'D' )
+	    return 0;
+
+	len = sp[11];
+	if ( len < SUFFIX_LEN || len > fp->size ) {
+	    printf ( "%s: DFU suffix length %d makes no sense\n", fp->name, len );
+	    return 1;
+	}
+
+	crc = sp[12] | (sp[13] << 8) | (sp[14] << 16) | ((uint32_t) sp[15] << 24);
+	if ( crc32_dfu ( buf, fp->size - 4 ) != crc ) {
+	    printf ( "%s: DFU suffix CRC is wrong, the file is damaged\n", fp->name );
+	    return 1;
+	}
+
+	fp->has_suffix = 1;
+	fp->suffix_bcd = get16 ( sp );
+	fp->suffix_product = get16 ( sp + 2 );
+	fp->suffix_vendor = get16 ( sp + 4 );
+	fp->size -= len;
+
+	if ( fp->size >= 5 && memcmp ( buf, "DfuSe", 5 ) == 0 ) {
+	    printf ( "%s: DfuSe container files are not supported, give me the raw image\n", fp->name );
+	    return 1;
+	}
+	return 0;
+}
+
+static int
+suffix_id_ok ( int want, int have )
+{
+	return want == SUFFIX_ANY || want == have;
+}
+
+/* Is this file meant for this board?  Returns 0 if so.
+ */
+int
+suffix_check ( struct dfu_file *fp, struct maple_device *mp )
+{
+	if ( ! fp->has_suffix )
+	    return 0;
+	if ( suffix_id_ok ( fp->suffix_vendor, mp->desc.idVendor ) &&
+		suffix_id_ok ( fp->suffix_product, mp->desc.idProduct ) &&
+		suffix_id_ok ( fp->suffix_bcd, mp->desc.bcdDevice ) )
+	    return 0;
+
+	printf ( "%s is for %04x:%04x (bcd %04x), this is %04x:%04x (bcd %04x)\n",
+	    fp->name, fp->suffix_vendor, fp->suffix_product, fp->suffix_bcd,
+	    mp->desc.idVendor, mp->desc.idProduct, mp->desc.bcdDevice );
+	return 1;
+}
+
+/* THE END */
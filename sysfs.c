@@ -0,0 +1,128 @@
+/* sysfs.c - maple-util
+ *
+ * Fast listing (-l) straight from sysfs.
+ *
+ * Just asking what is plugged in does not need libusb at all.
+ * The kernel already has the descriptors for every device under
+ * /sys/bus/usb/devices, in directories named by port path
+ * (like 1-1.2), so we read idVendor and friends from there.
+ * This saves libusb_init() and two walks of the device list,
+ * and takes a few milliseconds rather than a good fraction of
+ * a second, which matters to scripts that ask over and over.
+ *
+ * libusb still does the work whenever we flash.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+
+#include <libusb.h>
+
+#include "maple.h"
+
+#define SYSFS_USB	"/sys/bus/usb/devices"
+
+/* Read one line from a sysfs attribute, without the newline.
+ * Returns 0 if we got it.
+ */
+static int
+sysfs_read ( char *dev, char *attr, char *buf, int len )
+{
+	char path[256];
+	FILE *fp;
+	char *p;
+
+	snprintf ( path, sizeof(path), "%s/%s/%s", SYSFS_USB, dev, attr );
+	fp = fopen ( path, "r" );
+	if ( ! fp )
+	    return 1;
+	p = fgets ( buf, len, fp );
+	fclose ( fp );
+	if ( ! p )
+	    return 1;
+	p = strchr ( buf, '\n' );
+	if ( p )
+	    *p = '\0';
+	return 0;
+}
+
+static int
+sysfs_hex ( char *dev, char *attr )
+{
+	char buf[16];
+
+	if ( sysfs_read ( dev, attr, buf, sizeof(buf) ) )
+	    return -1;
+	return strtol ( buf, NULL, 16 );
+}
+
+/* Interfaces (1-1.2:1.0) live here too, we only want devices,
+ * and the root hubs (usb1) are of no interest.
+ */
+static int
+sysfs_filter ( const struct dirent *de )
+{
+	return de->d_name[0] != '.' && ! strchr ( de->d_name, ':' ) &&
+	    strncmp ( de->d_name, "usb", 3 ) != 0;
+}
+
+/* List what we find like list_maple() does, and count the
+ * Maples in *count the way it does.
+ * Returns what find_maple() would.
+ */
+int
+list_sysfs ( int verb, int *count )
+{
+	struct libusb_device_descriptor desc;
+	struct maple_profile *pp;
+	struct dirent **names;
+	char serial[64];
+	char *dev;
+	int first = MAPLE_NONE;
+	int kind;
+	int n;
+	int i;
+
+	*count = 0;
+	n = scandir ( SYSFS_USB, &names, sysfs_filter, alphasort );
+	if ( n < 0 ) {
+	    printf ( "Cannot read %s\n", SYSFS_USB );
+	    return MAPLE_NONE;
+	}
+
+	for ( i=0; i<n; i++ ) {
+	    dev = names[i]->d_name;
+
+	    memset ( &desc, 0, sizeof(desc) );
+	    desc.idVendor = sysfs_hex ( dev, "idVendor" );
+	    desc.idProduct = sysfs_hex ( dev, "idProduct" );
+	    desc.bcdDevice = sysfs_hex ( dev, "bcdDevice" );
+	    if ( sysfs_read ( dev, "serial", serial, sizeof(serial) ) )
+		strcpy ( serial, "-" );
+
+	    kind = profile_kind ( &desc );
+	    pp = profile_find ( desc.idVendor, desc.idProduct, desc.bcdDevice );
+	    if ( pp || kind != MAPLE_NONE )
+		(*count)++;
+	    if ( pp )
+		printf ( "Vendor:Device = %04x:%04x ---- %s on %s, serial %s\n",
+		    desc.idVendor, desc.idProduct, pp->name, dev, serial );
+	    else if ( kind != MAPLE_NONE )
+		printf ( "Vendor:Device = %04x:%04x ---- Maple in unknown mode !? on %s, serial %s\n",
+		    desc.idVendor, desc.idProduct, dev, serial );
+	    else if ( verb )
+		printf ( "Vendor:Device = %04x:%04x on %s\n",
+		    desc.idVendor, desc.idProduct, dev );
+
+	    if ( first == MAPLE_NONE )
+		first = kind;
+	    free ( names[i] );
+	}
+	free ( names );
+
+	return first;
+}
+
+/* THE END */
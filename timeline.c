@@ -0,0 +1,93 @@
+/* timeline.c - maple-util
+ *
+ * With -T file.json we write a timeline of the run in the Chrome
+ * trace event format, which chrome://tracing and the Perfetto UI
+ * (ui.perfetto.dev) both read.  Each board gets a track, and each
+ * thing we do to it is a span on that track: the serial trigger,
+ * waiting for the loader, opening it, every DFU request, the
+ * manifest phase, the reset and the boot confirmation.
+ * When a rack flashes at once, this shows where the time went,
+ * who waited on whom, and which board held everyone up.
+ *
+ * Tracks are per thread (each board has its own in bundle and
+ * audit mode), numbered as threads first show up.
+ * Events are written as they happen, under a lock.
+ */
+
+#include <stdio.h>
+#include <pthread.h>
+
+#include <libusb.h>
+
+#include "maple.h"
+
+int timeline_active = 0;
+
+static FILE *timeline_fp;
+static unsigned long long timeline_t0;
+static int timeline_ntracks;
+static pthread_mutex_t timeline_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread int timeline_tid;	/* 0 until we see this thread */
+
+int
+timeline_open ( char *path )
+{
+	timeline_fp = fopen ( path, "w" );
+	if ( ! timeline_fp ) {
+	    printf ( "Cannot open timeline file: %s\n", path );
+	    return 1;
+	}
+	timeline_t0 = nano_time ();
+	fprintf ( timeline_fp, "[\n" );
+	fprintf ( timeline_fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"maple-util\"}}" );
+	timeline_active = 1;
+	return 0;
+}
+
+/* Call with the lock held */
+static int
+timeline_track ( void )
+{
+	if ( ! timeline_tid )
+	    timeline_tid = ++timeline_ntracks;
+	return timeline_tid;
+}
+
+/* Give this thread's track a name, like the board's port path.
+ */
+void
+timeline_name ( char *name )
+{
+	if ( ! timeline_active )
+	    return;
+	pthread_mutex_lock ( &timeline_lock );
+	fprintf ( timeline_fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+	    timeline_track (), name );
+	pthread_mutex_unlock ( &timeline_lock );
+}
+
+/* Something that went from t0 to t1 (nano_time) on this thread's track.
+ */
+void
+timeline_span ( const char *name, unsigned long long t0, unsigned long long t1 )
+{
+	if ( ! timeline_active )
+	    return;
+	pthread_mutex_lock ( &timeline_lock );
+	fprintf ( timeline_fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+	    name, timeline_track (), (t0 - timeline_t0) / 1000.0, (t1 - t0) / 1000.0 );
+	pthread_mutex_unlock ( &timeline_lock );
+}
+
+void
+timeline_close ( void )
+{
+	if ( ! timeline_active )
+	    return;
+	timeline_active = 0;
+	fprintf ( timeline_fp, "\n]\n" );
+	fclose ( timeline_fp );
+}
+
+/* THE END */
@@ -0,0 +1,224 @@
+/* trace.c - maple-util
+ *
+ * Control transfer trace recorder, and a replayer that uses
+ * such a trace as a simulated device.
+ *
+ * In record mode, every transfer that goes through dfu_control()
+ * gets one fixed size record: the request, wValue, wLength,
+ * what libusb returned, a digest of the data phase, and
+ * monotonic start/end times relative to the start of the trace.
+ * For IN transfers (GETSTATUS, UPLOAD and such) the bytes we
+ * received follow the record, since replay needs to hand them back.
+ * OUT data only gets the digest, that is enough to check that
+ * the host is sending the same thing on replay.
+ *
+ * In replay mode, we hook dfu_control() and answer each request
+ * from the next record, taking as long as the real device did.
+ * The host side waits (bwPollTimeout and so on) come along
+ * for free, since they are driven by the replayed status replies.
+ *
+ * The file is in host byte order, which is fine for the little
+ * endian boxes we run on.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <libusb.h>
+
+#include "maple.h"
+#include "dfu.h"
+#include "hash.h"
+#include "trace.h"
+
+#define TRACE_MAGIC	"MPLTRC01"
+#define TRACE_MAGIC_LEN	8
+
+struct trace_rec {
+	uint8_t		type;		/* bmRequestType */
+	uint8_t		req;		/* bRequest */
+	uint16_t	value;		/* wValue */
+	uint16_t	index;		/* wIndex */
+	uint16_t	length;		/* wLength */
+	int32_t		result;		/* what libusb gave back */
+	uint32_t	payload;	/* IN bytes following this record */
+	uint64_t	digest;		/* hash of the data phase */
+	uint64_t	t_start;	/* ns since start of trace */
+	uint64_t	t_end;
+};
+
+int trace_active = 0;
+
+static FILE *trace_fp;
+static char *trace_path;
+static int trace_replaying;
+static int trace_count;
+static int trace_diverged;
+static unsigned long long trace_t0;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int
+trace_record_open ( char *path )
+{
+	trace_fp = fopen ( path, "w" );
+	if ( ! trace_fp ) {
+	    printf ( "Cannot create trace file: %s\n", path );
+	    return 1;
+	}
+	fwrite ( TRACE_MAGIC, 1, TRACE_MAGIC_LEN, trace_fp );
+
+	trace_path = path;
+	trace_count = 0;
+	trace_t0 = nano_time ();
+	trace_active = 1;
+	return 0;
+}
+
+void
+trace_record ( struct dfu_xfer *xp, int result,
+	unsigned long long t_start, unsigned long long t_end )
+{
+	struct trace_rec rec;
+	int in = xp->bmRequestType & LIBUSB_ENDPOINT_IN;
+	int n = 0;
+
+	memset ( &rec, 0, sizeof(rec) );
+	rec.type = xp->bmRequestType;
+	rec.req = xp->bRequest;
+	rec.value = xp->wValue;
+	rec.index = xp->wIndex;
+	rec.length = xp->wLength;
+	rec.result = result;
+	rec.t_start = t_start - trace_t0;
+	rec.t_end = t_end - trace_t0;
+
+	if ( xp->data ) {
+	    if ( ! in )
+		n = xp->wLength;
+	    else if ( result > 0 )
+		n = result < xp->wLength ? result : xp->wLength;
+	}
+	rec.digest = hash_buf ( xp->data, n );
+	if ( in )
+	    rec.payload = n;
+
+	pthread_mutex_lock ( &trace_lock );
+	fwrite ( &rec, sizeof(rec), 1, trace_fp );
+	if ( rec.payload )
+	    fwrite ( xp->data, 1, rec.payload, trace_fp );
+	trace_count++;
+	pthread_mutex_unlock ( &trace_lock );
+}
+
+static void
+nano_sleep ( unsigned long long ns )
+{
+	struct timespec delay;
+
+	delay.tv_sec = ns / 1000000000ULL;
+	delay.tv_nsec = ns % 1000000000ULL;
+	nanosleep ( &delay, NULL );
+}
+
+/* Play the part of the device.
+ * We don't insist the host does exactly what it did when the
+ * trace was made, but we do complain when it doesn't, since
+ * the timing after that point is not to be trusted.
+ */
+static int
+trace_replay_xfer ( libusb_device_handle *devh, struct dfu_xfer *xp )
+{
+	struct trace_rec rec;
+	int in = xp->bmRequestType & LIBUSB_ENDPOINT_IN;
+	int n;
+
+	pthread_mutex_lock ( &trace_lock );
+	if ( fread ( &rec, sizeof(rec), 1, trace_fp ) != 1 ) {
+	    pthread_mutex_unlock ( &trace_lock );
+	    printf ( "Replay: trace ends after %d transfers\n", trace_count );
+	    return LIBUSB_ERROR_NO_DEVICE;
+	}
+	trace_count++;
+
+	if ( rec.req != xp->bRequest || rec.value != xp->wValue ||
+		rec.length != xp->wLength ) {
+	    trace_diverged++;
+	    printf ( "Replay: transfer %d diverges, trace has %s(%d,%d), host sent %s(%d,%d)\n",
+		trace_count,
+		dfu_request_to_string ( rec.req ), rec.value, rec.length,
+		dfu_request_to_string ( xp->bRequest ), xp->wValue, xp->wLength );
+	} else if ( ! in && xp->data && rec.digest != hash_buf ( xp->data, xp->wLength ) ) {
+	    trace_diverged++;
+	    printf ( "Replay: transfer %d, %s payload differs from trace\n",
+		trace_count, dfu_request_to_string ( rec.req ) );
+	}
+
+	if ( rec.payload ) {
+	    n = rec.payload;
+	    if ( in && xp->data && n <= xp->wLength ) {
+		if ( fread ( xp->data, 1, n, trace_fp ) != (size_t) n )
+		    rec.result = LIBUSB_ERROR_IO;
+	    } else
+		fseek ( trace_fp, n, SEEK_CUR );
+	}
+	pthread_mutex_unlock ( &trace_lock );
+
+	/* Take as long as the device did */
+	nano_sleep ( rec.t_end - rec.t_start );
+
+	return rec.result;
+}
+
+int
+trace_replay_open ( char *path )
+{
+	char magic[TRACE_MAGIC_LEN];
+
+	trace_fp = fopen ( path, "r" );
+	if ( ! trace_fp ) {
+	    printf ( "Cannot open trace file: %s\n", path );
+	    return 1;
+	}
+
+	if ( fread ( magic, 1, TRACE_MAGIC_LEN, trace_fp ) != TRACE_MAGIC_LEN ||
+		memcmp ( magic, TRACE_MAGIC, TRACE_MAGIC_LEN ) != 0 ) {
+	    printf ( "Not a maple-util trace file: %s\n", path );
+	    fclose ( trace_fp );
+	    trace_fp = NULL;
+	    return 1;
+	}
+
+	trace_path = path;
+	trace_count = 0;
+	trace_diverged = 0;
+	trace_replaying = 1;
+	dfu_xfer_hook = trace_replay_xfer;
+	return 0;
+}
+
+void
+trace_close ( void )
+{
+	if ( ! trace_fp )
+	    return;
+
+	if ( trace_replaying ) {
+	    printf ( "Replayed %d transfers from %s", trace_count, trace_path );
+	    if ( trace_diverged )
+		printf ( ", %d diverged", trace_diverged );
+	    printf ( "\n" );
+	    dfu_xfer_hook = NULL;
+	    trace_replaying = 0;
+	} else {
+	    printf ( "Traced %d transfers to %s\n", trace_count, trace_path );
+	    trace_active = 0;
+	}
+
+	fclose ( trace_fp );
+	trace_fp = NULL;
+}
+
+/* THE END */
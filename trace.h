@@ -0,0 +1,19 @@
+/* trace.h - maple-util
+ *
+ * Record every control transfer to a binary trace file,
+ * and play such a file back as a simulated device.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+struct dfu_xfer;
+
+extern int trace_active;
+
+int trace_record_open ( char * );
+void trace_record ( struct dfu_xfer *, int, unsigned long long, unsigned long long );
+int trace_replay_open ( char * );
+void trace_close ( void );
+
+#endif /* TRACE_H */
@@ -0,0 +1,157 @@
+/* watch.c - maple-util
+ *
+ * Watch mode.  Sit on the image file with inotify and
+ * reflash the board every time a new image shows up.
+ *
+ * We watch the directory rather than the file itself, since
+ * linkers and editors often write a new file and rename it
+ * into place, and a watch on the old inode would never see that.
+ *
+ * Everything that costs time at startup stays warm from one
+ * cycle to the next: the libusb context, the tty we found the
+ * board on last time, and the image itself (we only reread it
+ * when inotify tells us to, and skip the flash if nothing changed).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/inotify.h>
+
+#include <libusb.h>
+
+#include "maple.h"
+#include "hash.h"
+
+extern int verbose;
+
+/* How long things must be quiet before we believe
+ * whoever was writing the file is done with it.
+ */
+#define WATCH_DEBOUNCE	100	/* ms */
+
+#define WATCH_EVENTS	(IN_CLOSE_WRITE | IN_MOVED_TO)
+
+/* Read what inotify has for us, say if any of it was our file.
+ */
+static int
+watch_read ( int fd, char *base )
+{
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *ev;
+	char *p;
+	int n;
+	int hit = 0;
+
+	n = read ( fd, buf, sizeof(buf) );
+	for ( p = buf; p < buf + n; p += sizeof(*ev) + ev->len ) {
+	    ev = (struct inotify_event *) p;
+	    if ( ev->len && strcmp ( ev->name, base ) == 0 )
+		hit = 1;
+	}
+	return hit;
+}
+
+/* Block until our file gets written, then wait for
+ * things to settle down.
+ */
+static void
+watch_wait ( int fd, char *base )
+{
+	struct pollfd pfd;
+
+	while ( ! watch_read ( fd, base ) )
+	    ;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while ( poll ( &pfd, 1, WATCH_DEBOUNCE ) > 0 )
+	    watch_read ( fd, base );
+}
+
+int
+watch_file ( libusb_context *context, struct dfu_file *fp )
+{
+	struct dfu_file new;
+	char dir[256];
+	char *base;
+	uint64_t hash;
+	uint64_t new_hash;
+	unsigned long long t0;
+	int fd;
+	int m;
+	int s;
+
+	base = strrchr ( fp->name, '/' );
+	if ( base ) {
+	    snprintf ( dir, sizeof(dir), "%.*s", (int) (base - fp->name), fp->name );
+	    if ( ! dir[0] )
+		strcpy ( dir, "/" );
+	    base++;
+	} else {
+	    strcpy ( dir, "." );
+	    base = fp->name;
+	}
+
+	fd = inotify_init1 ( IN_CLOEXEC );
+	if ( fd < 0 ) {
+	    printf ( "Cannot set up inotify\n" );
+	    return 1;
+	}
+	if ( inotify_add_watch ( fd, dir, WATCH_EVENTS ) < 0 ) {
+	    printf ( "Cannot watch directory: %s\n", dir );
+	    close ( fd );
+	    return 1;
+	}
+
+	file_wait ( fp );
+	hash = fp->digest;
+
+	for ( ;; ) {
+	    printf ( "Watching %s\n", fp->name );
+	    watch_wait ( fd, base );
+	    t0 = nano_time ();
+
+	    /* Nothing of the old one, so put_file() can't free it */
+	    new = *fp;
+	    new.buf = NULL;
+	    if ( get_file ( &new ) ) {
+		printf ( "Cannot read %s, waiting for the next change\n", fp->name );
+		put_file ( &new );
+		continue;
+	    }
+	    if ( file_wait ( &new ) ) {
+		put_file ( &new );
+		continue;
+	    }
+	    new_hash = new.digest;
+	    if ( new.size == 0 || new_hash == hash ) {
+		printf ( "%s has not changed\n", fp->name );
+		put_file ( &new );
+		continue;
+	    }
+
+	    put_file ( fp );
+	    *fp = new;
+	    hash = new_hash;
+	    if ( verbose )
+		printf ( "Read %d bytes from: %s\n", fp->size, fp->name );
+
+	    m = find_maple ( context, NULL );
+	    if ( m != MAPLE_SERIAL && m != MAPLE_LOADER ) {
+		printf ( "No maple device found\n" );
+		continue;
+	    }
+
+	    s = flash_board ( context, m, fp );
+	    printf ( "%s in %.3f seconds\n", s ? "Reflash failed" : "Reflashed",
+		(nano_time() - t0) / 1.0e9 );
+	}
+
+	/* NOTREACHED */
+	return 0;
+}
+
+/* THE END */